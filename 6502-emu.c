@@ -1,46 +1,149 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <termios.h>
+#include <signal.h>
 #include <time.h>
+#include <errno.h>
 
 #include "6502.h"
 #include "6850.h"
+#include "cache.h"
+#include "jit.h"
+#include "trace.h"
+#include "dump.h"
+#include "profile.h"
+#include "stats.h"
+#include "idle.h"
+#include "hle.h"
 
 struct termios initial_termios;
 
-void step_delay()
+/* Pacing */
+
+// Each slice of emulated time has a deadline on the monotonic clock, so time
+// spent running a slice comes out of the sleep after it rather than adding
+// to it. A slice that overruns is made up by not sleeping until the machine
+// has caught up, unless it falls more than max_lag behind, in which case the
+// lost time is written off.
+
+typedef struct {
+	double freq; // target clock rate in Hz
+	uint64_t slice_cycles; // cycles run between sleeps
+	int64_t slice_ns;
+	int64_t max_lag_ns;
+	int64_t next; // when the current slice is due to end
+	uint64_t due; // total_cycles at which it ends
+	int64_t start; // when the run started
+	uint64_t start_cycles;
+} Pacer;
+
+static int64_t now_ns(void)
 {
-	struct timespec req, rem;
-	
-	req.tv_sec = 0;
-	req.tv_nsec = STEP_DURATION;
-	
-	nanosleep(&req, &rem);
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * (int64_t)ONE_SECOND + t.tv_nsec;
 }
 
-void run_cpu(long cycle_stop, int verbose, int mem_dump, int break_pc, int fast)
+static void wait_until(Pacer * pacer, int64_t deadline) // returns at deadline, or now if that's too far behind
 {
-	long cycles = 0;
-	int cycles_per_step = (CPU_FREQ / (ONE_SECOND / STEP_DURATION));
-	
-	for (;;) {
-		for (cycles %= cycles_per_step; cycles < cycles_per_step;) {
-			if (mem_dump) save_memory(NULL);
-			cycles += step_cpu(verbose);
-			if ((cycle_stop > 0) && (total_cycles >= cycle_stop)) goto end;
-			step_uart();
-
-			if (break_pc >= 0 && PC == (uint16_t)break_pc) {
-				fprintf(stderr, "break at %04x\n", break_pc);
-				save_memory(NULL);
-				goto end;
-			}
-		}
-		if (!fast) step_delay();
+	int64_t now = now_ns();
+	struct timespec t;
+
+	if (now - deadline > pacer->max_lag_ns) {
+		pacer->next = now; // too far behind; carry on from here
+	} else if (deadline > now) {
+		t.tv_sec = deadline / (int64_t)ONE_SECOND;
+		t.tv_nsec = deadline % (int64_t)ONE_SECOND;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
 	}
-end:
-	return;
+}
+
+void pace(CPU * cpu, void * data) // keeps emulation close to pacer->freq
+{
+	Pacer * pacer = data;
+
+	wait_until(pacer, pacer->next);
+	pacer->next += pacer->slice_ns;
+	// from the slice's own end rather than total_cycles, so that an event
+	// that runs late (after a compiled block, say) doesn't push the rest back
+	pacer->due += pacer->slice_cycles;
+	schedule(cpu, pacer->due, pace, pacer);
+}
+
+void start_pacing(CPU * cpu, Pacer * pacer)
+{
+	pacer->slice_cycles = pacer->freq * pacer->slice_ns / ONE_SECOND;
+	if (pacer->slice_cycles == 0) pacer->slice_cycles = 1;
+	pacer->start = now_ns();
+	pacer->start_cycles = cpu->total_cycles;
+	pacer->next = pacer->start + pacer->slice_ns;
+	pacer->due = cpu->total_cycles + pacer->slice_cycles;
+	schedule(cpu, pacer->due, pace, pacer);
+}
+
+void report_pacing(CPU * cpu, Pacer * pacer)
+{
+	double seconds;
+
+	// the last slice has run but not been slept; wait until the time its cycles are due
+	wait_until(pacer, pacer->next - (int64_t)(((double)pacer->due - cpu->total_cycles) * ONE_SECOND / pacer->freq));
+	seconds = (now_ns() - pacer->start) / ONE_SECOND;
+
+	if (seconds <= 0) return;
+	fprintf(stderr, "ran at %.3f MHz (target %.3f MHz)\n",
+		(cpu->total_cycles - pacer->start_cycles) / seconds / 1e6, pacer->freq / 1e6);
+}
+
+void run_cpu(CPU * cpu, long cycle_stop, Pacer * pacer) // pacer is NULL to run flat out
+{
+	int why;
+
+	if (pacer) start_pacing(cpu, pacer);
+	
+	why = run_cycles(cpu, cycle_stop > 0 ? cycle_stop : UINT64_MAX);
+	if (pacer) report_pacing(cpu, pacer);
+	if (why == 0) return;
+	if (cpu->ring) dump_ring(cpu, stderr);
+	if (why == RUN_BREAK)
+		fprintf(stderr, "break at %04x\n", cpu->break_pc);
+	else
+		fprintf(stderr, "stuck at %04x\n", cpu->PC);
+	save_memory(cpu, NULL);
+}
+
+CPU * signal_cpu; // for dump_on_signal
+
+void dump_on_signal(int sig) // SIGSEGV; the process is going down anyway
+{
+	if (signal_cpu->ring) dump_ring(signal_cpu, stderr);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// SIGINT only sets a flag. The reports are written by the CPU's own thread
+// once check_interrupt has stopped the run, so nothing is freed under it.
+
+#define INTERRUPT_CHECK_CYCLES 100000 // how often a SIGINT is looked for
+
+volatile sig_atomic_t interrupted;
+
+void stop_on_signal(int sig)
+{
+	interrupted = 1;
+}
+
+void check_interrupt(CPU * cpu, void * data)
+{
+	if (interrupted) halt_cpu(cpu);
+	else schedule(cpu, cpu->total_cycles + INTERRUPT_CHECK_CYCLES, check_interrupt, NULL);
+}
+
+void request_on_signal(int sig)
+{
+	request_stats(signal_cpu);
 }
 
 void restore_stdin()
@@ -68,7 +171,7 @@ int hextoint(char *str) {
 }
 
 void usage(char *argv[]) {
-	fprintf(stderr, "Usage: %s [OPTIONS] FILE\n"
+	fprintf(stderr, "Usage: %s [OPTIONS] [FILE]\n"
 		"Simulate a NMOS 6502 processor\n"
 		"\nOPTIONS:\n"
 		"\n  CPU Initialization (specify all values in hex; $nn, 0xNN, etc.)\n"
@@ -80,22 +183,68 @@ void usage(char *argv[]) {
 		"	-r ADDR	set initial run address (default: use value at RST_VEC)\n"
 		"\n  Emulator Control\n"
 		"	-v	print CPU info at every step\n"
+		"	-m	keep the file memdump up to date with memory before each\n"
+		"		step (only the pages that changed are rewritten)\n"
+		"	-M FILE	write the pages each step changes to FILE, with a full copy\n"
+		"		every %d steps (rebuild memory with memrebuild.py)\n"
+		"	-t FILE	write a binary trace of every step to FILE (decode it\n"
+		"		with trace2log.py)\n"
 		"	-i	connect stdin/stdout to the emulator\n"
+		"	-u PATH	read UART input from PATH (a fifo, tty, pty or /dev/fd/N)\n"
+		"		instead of stdin\n"
+		"	-o PATH	write UART output to PATH instead of stdout\n"
 		"	-b ADDR	stop when PC reaches this address, write memory dump, and exit\n"
+		"	-S NUM	stop like -b when the PC stays the same for NUM steps in a\n"
+		"		row (a jump to itself)\n"
+		"	-R NUM	remember the last NUM steps and print them on -b, -S,\n"
+		"		SIGINT and SIGSEGV (with -J a compiled block is one step)\n"
+		"	-P FILE	count the cycles spent at each address and write a report of\n"
+		"		the hottest addresses to FILE (- for stdout) when the run\n"
+		"		stops or on SIGINT\n"
+		"	-n FILE	read labels for the -P report from FILE (\"name = $c000\",\n"
+		"		\"c000 name\" or VICE \"al C:c000 .name\" lines)\n"
+		"	-T FILE	count instructions by opcode and addressing mode, page\n"
+		"		crossings and taken branches, and write them to FILE as\n"
+		"		CSV (JSON if FILE ends in .json) at exit, on SIGINT and on\n"
+		"		SIGUSR1; only in 6502-emu-stats (make stats)\n"
 		"	-c NUM	exit after number of cycles (default: never)\n"
+		"	-L FILE	start from a snapshot written by -w instead of resetting\n"
+		"	-w FILE	write a snapshot to FILE when the run stops\n"
 		"	-f	run as fast as possible; no delay loop\n"
+		"	-F HZ	clock rate to run at without -f (default %.0f)\n"
+		"	-q USEC	emulated time between sleeps without -f (default %.0f)\n"
+		"	-K MSEC	how far behind the clock rate a slow host may fall before\n"
+		"		the lost time is given up rather than caught up (default %.0f)\n"
+		"	-I	run loops that only poll a device instruction by instruction\n"
+		"		instead of skipping ahead to the next event\n"
+		"	-B	cache predecoded basic blocks\n"
+		"	-J	compile hot code to native x86-64 (-b and -c are only\n"
+		"		checked between compiled blocks)\n"
+		"	-H	run known ROM routines as native code when the ROM is one\n"
+		"		they're written for (ehBASIC 2.22: variable lookup and\n"
+		"		floating point multiply)\n"
+		"	-E	like -H, but run the guest code as well and report where\n"
+		"		the two differ (can't be combined with -B or -J)\n"
+		"	-C NUM	cycles to charge for each native routine call (default:\n"
+		"		as many as the guest code takes)\n"
 		"\n  Memory Initialization\n"
 		"	-l ADDR	load address for ROM file (default $c000)\n"
-		"	FILE	binary file to load\n"
-		, argv[0]);
+		"	FILE	binary file to load (optional with -L)\n"
+		, argv[0], DUMP_KEYFRAME_STEPS, CPU_FREQ, STEP_DURATION / 1e3, MAX_LAG / 1e6);
 }
 
 int main(int argc, char *argv[])
 {
 	int a, x, y, sp, sr, pc, load_addr;
-	int verbose, interactive, mem_dump, break_pc, fast;
-	long cycles;
+	int verbose, interactive, mem_dump, break_pc, fast, block_cache, jit, idle, hle, verify_hle, input_fd;
+	long ring_size, stuck_limit;
+	char * input_path, * output_path, * trace_path, * load_path, * save_path, * stream_path, * profile_path, * symbol_path, * stats_path;
+	FILE * output;
+	long cycles, hle_cost;
 	int opt;
+	CPU * cpu;
+	Uart uart;
+	Pacer pacer;
 
 	verbose = 0;
 	interactive = 0;
@@ -104,13 +253,33 @@ int main(int argc, char *argv[])
 	load_addr = 0xC000;
 	break_pc = -1;
 	fast = 0;
+	pacer.freq = CPU_FREQ;
+	pacer.slice_ns = STEP_DURATION;
+	pacer.max_lag_ns = MAX_LAG;
+	block_cache = 0;
+	jit = 0;
+	idle = 1;
+	hle = 0;
+	verify_hle = 0;
+	hle_cost = 0;
+	input_path = NULL;
+	output_path = NULL;
+	trace_path = NULL;
+	load_path = NULL;
+	save_path = NULL;
+	stream_path = NULL;
+	profile_path = NULL;
+	symbol_path = NULL;
+	stats_path = NULL;
+	ring_size = 0;
+	stuck_limit = 0;
 	a = 0;
 	x = 0;
 	y = 0;
 	sp = 0xFF;
 	sr = 0;
 	pc = -RST_VEC;  // negative implies indirect
-	while ((opt = getopt(argc, argv, "hvimfa:b:x:y:r:p:s:g:c:l:")) != -1) {
+	while ((opt = getopt(argc, argv, "hvimfBJIHEC:F:q:K:a:b:x:y:r:p:s:g:c:l:u:o:t:R:S:L:w:M:P:n:T:")) != -1) {
 		switch (opt) {
 		case 'v':
 			verbose = 1;
@@ -121,9 +290,49 @@ int main(int argc, char *argv[])
 		case 'm':
 			mem_dump = 1;
 			break;
+		case 'M':
+			stream_path = optarg;
+			break;
+		case 'P':
+			profile_path = optarg;
+			break;
+		case 'n':
+			symbol_path = optarg;
+			break;
+		case 'T':
+			stats_path = optarg;
+			break;
 		case 'f':
 			fast = 1;
 			break;
+		case 'I':
+			idle = 0;
+			break;
+		case 'H':
+			hle = 1;
+			break;
+		case 'E':
+			hle = 1;
+			verify_hle = 1;
+			break;
+		case 'C':
+			hle_cost = atol(optarg);
+			break;
+		case 'F':
+			pacer.freq = atof(optarg);
+			break;
+		case 'q':
+			pacer.slice_ns = atof(optarg) * 1e3;
+			break;
+		case 'K':
+			pacer.max_lag_ns = atof(optarg) * 1e6;
+			break;
+		case 'B':
+			block_cache = 1;
+			break;
+		case 'J':
+			jit = 1;
+			break;
 		case 'b':
 			break_pc = hextoint(optarg);
 			break;
@@ -152,6 +361,27 @@ int main(int argc, char *argv[])
 		case 'l':
 			load_addr = hextoint(optarg);
 			break;
+		case 'u':
+			input_path = optarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'R':
+			ring_size = atol(optarg);
+			break;
+		case 'S':
+			stuck_limit = atol(optarg);
+			break;
+		case 'L':
+			load_path = optarg;
+			break;
+		case 'w':
+			save_path = optarg;
+			break;
 		case 'h':
 		default: /* '?' */
 			usage(argv);
@@ -159,12 +389,43 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc) {
+	if (block_cache && jit) {
+	   fprintf(stderr, "Error: -B and -J can't be combined\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (stats_path && jit) {
+	   fprintf(stderr, "Error: -T and -J can't be combined (compiled blocks aren't counted)\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (stats_path && hle) {
+	   fprintf(stderr, "Error: -T can't be combined with -H or -E (native routines aren't counted)\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (verify_hle && (block_cache || jit)) {
+	   fprintf(stderr, "Error: -E can't be combined with -B or -J (compiled code would run past the routines)\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (pacer.freq <= 0 || pacer.slice_ns <= 0) {
+	   fprintf(stderr, "Error: -F and -q must be positive\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (optind >= argc && load_path == NULL) {
 	   fprintf(stderr, "Error: expected binary file to load\n\n");
 	   usage(argv);
 	   exit(EXIT_FAILURE);
 	}
-	if (load_rom(argv[optind], load_addr) != 0) {
+	cpu = calloc(1, sizeof(CPU));
+	if (cpu == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	init_bus(cpu);
+	if (optind < argc && load_rom(cpu, argv[optind], load_addr) != 0) {
 		printf("Error loading \"%s\".\n", argv[optind]);
 		return EXIT_FAILURE;
 	}
@@ -172,10 +433,95 @@ int main(int argc, char *argv[])
 	if (interactive) raw_stdin(); // allow individual keystrokes to be detected
 	
 	init_tables();
-	init_uart();
+	input_fd = input_path ? open(input_path, O_RDONLY) : 0;
+	if (input_fd < 0) {
+		fprintf(stderr, "Error: could not open \"%s\"\n", input_path);
+		return EXIT_FAILURE;
+	}
+	output = output_path ? fopen(output_path, "w") : stdout;
+	if (output == NULL) {
+		fprintf(stderr, "Error: could not open \"%s\"\n", output_path);
+		return EXIT_FAILURE;
+	}
+	if (init_uart(&uart, cpu, input_fd, output) != 0) {
+		fprintf(stderr, "Error: could not start the input thread\n");
+		return EXIT_FAILURE;
+	}
+	if (idle && init_idle(cpu) != 0) {
+		fprintf(stderr, "Error: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (block_cache && init_block_cache(cpu) != 0) {
+		fprintf(stderr, "Error: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (jit && init_jit(cpu) != 0) {
+		fprintf(stderr, "Error: could not set up the JIT\n");
+		return EXIT_FAILURE;
+	}
 	
-	reset_cpu(a, x, y, sp, sr, pc);
-	run_cpu(cycles, verbose, mem_dump, break_pc, fast);
+	if (trace_path && open_trace(cpu, trace_path) != 0) {
+		fprintf(stderr, "Error: could not open \"%s\"\n", trace_path);
+		return EXIT_FAILURE;
+	}
+	if (profile_path && open_profile(cpu, profile_path, symbol_path) != 0) {
+		fprintf(stderr, "Error: could not set up the profile\n");
+		return EXIT_FAILURE;
+	}
+	signal_cpu = cpu;
+	if (ring_size > 0) {
+		if (init_ring(cpu, ring_size) != 0) {
+			fprintf(stderr, "Error: out of memory\n");
+			return EXIT_FAILURE;
+		}
+		signal(SIGSEGV, dump_on_signal);
+	}
+	if (stats_path && open_stats(cpu, stats_path) != 0) {
+		fprintf(stderr, "Error: -T needs 6502-emu-stats, built with make stats\n");
+		return EXIT_FAILURE;
+	}
+	if (ring_size > 0 || profile_path || stats_path) {
+		signal(SIGINT, stop_on_signal);
+		schedule(cpu, cpu->total_cycles + INTERRUPT_CHECK_CYCLES, check_interrupt, NULL);
+	}
+	if (stats_path) signal(SIGUSR1, request_on_signal);
+	
+	if (load_path == NULL) {
+		reset_cpu(cpu, a, x, y, sp, sr, pc);
+	} else if (load_state(cpu, load_path) != 0) { // after init_uart, which registers its state
+		fprintf(stderr, "Error: could not load snapshot \"%s\"\n", load_path);
+		return EXIT_FAILURE;
+	}
+	if (hle && init_hle(cpu, hle_cost, verify_hle) != 0) { // once memory holds the ROM
+		fprintf(stderr, "Error: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (hle && cpu->hle == NULL) fprintf(stderr, "Warning: no native routines for this ROM; running it as it is\n");
+	if ((mem_dump || stream_path) && open_dump(cpu, mem_dump ? "memdump" : NULL, stream_path) != 0) {
+		fprintf(stderr, "Error: could not open the memory dump\n");
+		return EXIT_FAILURE;
+	}
+	cpu->run_flags = (verbose ? RUN_TRACE : 0) | (mem_dump || stream_path ? RUN_DUMP : 0) | (break_pc >= 0 ? RUN_BREAK : 0)
+		| (trace_path ? RUN_RECORD : 0) | (ring_size > 0 ? RUN_RING : 0) | (stuck_limit > 0 ? RUN_STUCK : 0)
+		| (profile_path ? RUN_PROFILE : 0);
+	cpu->break_pc = break_pc;
+	cpu->stuck_limit = stuck_limit;
+	run_cpu(cpu, cycles, fast ? NULL : &pacer);
+	if (interrupted && cpu->ring) dump_ring(cpu, stderr);
+	if (!interrupted && save_path && save_state(cpu, save_path) != 0) {
+		fprintf(stderr, "Error: could not write snapshot \"%s\"\n", save_path);
+	}
+	close_trace(cpu);
+	close_dump(cpu);
+	close_profile(cpu);
+	close_stats(cpu);
+	free_ring(cpu);
+	free_jit(cpu);
+	free_block_cache(cpu);
+	free_idle(cpu);
+	free_hle(cpu);
+	free_state(cpu);
+	free(cpu);
 	
-	return EXIT_SUCCESS;
+	return interrupted ? EXIT_FAILURE : EXIT_SUCCESS;
 }
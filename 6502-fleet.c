@@ -0,0 +1,637 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "6502.h"
+#include "6850.h"
+#include "cache.h"
+#include "jit.h"
+#include "idle.h"
+#include "hle.h"
+#include "lockstep.h"
+
+// Runs every job in a manifest, each on its own machine, on a pool of worker
+// threads. The manifest has one job per line, as KEY=VALUE words:
+//
+//   rom=FILE load=ADDR a=HEX x=HEX y=HEX s=HEX p=HEX r=ADDR cycles=NUM
+//   input=FILE output=FILE|- patch=ADDR:HEXBYTES break=ADDR stuck=NUM name=TEXT
+//
+// Only rom is required; the rest default as in 6502-emu, with cycles from -c.
+// input is typed into the 6850 as fast as the guest reads it, output=- puts
+// what the guest printed into the job's record, and patch (which may be
+// repeated) writes bytes into memory before the reset. Blank lines and lines
+// starting with # are skipped.
+//
+// Every distinct ROM and load address is built into a 64KB memory image
+// once, and each machine maps it copy-on-write, so only the pages a job
+// writes to are its own. Input files are read once as well.
+//
+// Work is handed out in batches: one job each, or with -V groups of
+// LOCKSTEP_MIN_LANES to LOCKSTEP_LANES jobs that can start out in lockstep
+// (see lockstep.c). Each worker starts with an even share of the batches,
+// takes its own from the front, and once they run out steals from the back
+// of the others. Results are written as one JSON object per line as jobs
+// finish, in whatever order that happens; "job" is the manifest line.
+
+#define FLEET_CYCLES 100000000 // budget for jobs without cycles=
+#define MAX_WORKERS 256
+
+typedef struct Image { // a ROM loaded at an address, shared by every job that uses it
+	char * path;
+	int load_addr;
+	int fd; // memfd holding the 64KB image
+	struct Image * next;
+} Image;
+
+typedef struct Script { // an input file, shared likewise
+	char * path;
+	uint8_t * data;
+	size_t size;
+	struct Script * next;
+} Script;
+
+typedef struct {
+	uint16_t addr;
+	uint16_t size;
+	uint8_t * bytes;
+} Patch;
+
+typedef struct {
+	int line; // in the manifest
+	char * name;
+	Image * image;
+	Script * input; // NULL for no input
+	char * output; // NULL to discard, "-" to capture into the record, or a file
+	int a, x, y, sp, sr, pc;
+	uint64_t cycles;
+	int break_pc;
+	long stuck_limit;
+	Patch * patches;
+	int num_patches;
+} Job;
+
+typedef struct { // jobs that run on the same worker, together if there's more than one
+	Job ** jobs;
+	int count;
+} Batch;
+
+typedef struct { // the batches a worker hasn't started yet
+	pthread_mutex_t lock;
+	int head; // the owner takes from here
+	int tail; // thieves take from one below here
+} Deque;
+
+static Job * jobs;
+static int num_jobs;
+static Batch * batches;
+static int num_batches;
+static Image * images;
+static Script * scripts;
+static Deque deques[MAX_WORKERS];
+static int num_workers;
+static int use_cache, use_jit, use_hle, use_idle = 1;
+static FILE * results;
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_errors;
+
+static double now_seconds(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / ONE_SECOND;
+}
+
+static int hextoint(char *str) {
+	int val;
+
+	if (*str == '$') str++;
+	val = strtol(str, NULL, 16);
+	return val;
+}
+
+/* Shared Images */
+
+static Image * get_image(char * path, int load_addr) // NULL if the ROM can't be read
+{
+	static uint8_t buf[MEMORY_SIZE]; // only used while the manifest is read
+	Image * image;
+	FILE * fp;
+	int fd;
+
+	for (image = images; image; image = image->next)
+		if (image->load_addr == load_addr && strcmp(image->path, path) == 0) return image;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) return NULL;
+	memset(buf, 0, sizeof(buf)); // same as load_rom
+	if (fread(&buf[load_addr], 1, MEMORY_SIZE - load_addr, fp) == 0 && ferror(fp)) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	fd = memfd_create("6502-image", MFD_CLOEXEC);
+	if (fd < 0) return NULL;
+	if (pwrite(fd, buf, MEMORY_SIZE, 0) != MEMORY_SIZE || (image = malloc(sizeof(Image))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	image->path = strdup(path);
+	image->load_addr = load_addr;
+	image->fd = fd;
+	image->next = images;
+	images = image;
+	return image;
+}
+
+static Script * get_script(char * path) // NULL if the file can't be read
+{
+	Script * script;
+	FILE * fp;
+	long size;
+
+	for (script = scripts; script; script = script->next)
+		if (strcmp(script->path, path) == 0) return script;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) return NULL;
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0
+			|| (script = malloc(sizeof(Script))) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	script->data = malloc(size ? size : 1);
+	if (script->data == NULL || fread(script->data, 1, size, fp) != (size_t)size) {
+		free(script->data);
+		free(script);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	script->path = strdup(path);
+	script->size = size;
+	script->next = scripts;
+	scripts = script;
+	return script;
+}
+
+/* Manifest */
+
+static int parse_patch(Job * job, char * value) // ADDR:HEXBYTES
+{
+	char * bytes = strchr(value, ':');
+	Patch * patch;
+	size_t i, len;
+
+	if (bytes == NULL) return -1;
+	*bytes++ = '\0';
+	len = strlen(bytes);
+	if (len == 0 || len % 2 != 0 || strspn(bytes, "0123456789abcdefABCDEF") != len) return -1;
+	patch = realloc(job->patches, (job->num_patches + 1) * sizeof(Patch));
+	if (patch == NULL) return -1;
+	job->patches = patch;
+	patch = &job->patches[job->num_patches++];
+	patch->addr = hextoint(value);
+	patch->size = len / 2;
+	patch->bytes = malloc(patch->size);
+	if (patch->bytes == NULL || patch->addr + patch->size > MEMORY_SIZE) return -1;
+	for (i = 0; i < patch->size; i++) {
+		char hex[3] = { bytes[2 * i], bytes[2 * i + 1], '\0' };
+		patch->bytes[i] = strtol(hex, NULL, 16);
+	}
+	return 0;
+}
+
+static int parse_job(Job * job, int n, char * line, uint64_t cycles) // returns -1 and prints why on a bad line
+{
+	char * rom = NULL, * input = NULL, * word, * value;
+	int load_addr = 0xC000;
+
+	*job = (Job) {
+		.line = n,
+		.sp = 0xFF,
+		.pc = -RST_VEC, // negative implies indirect
+		.cycles = cycles,
+		.break_pc = -1,
+	};
+	for (word = strtok(line, " \t\r\n"); word; word = strtok(NULL, " \t\r\n")) {
+		value = strchr(word, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Error: manifest line %d: expected KEY=VALUE, not \"%s\"\n", job->line, word);
+			return -1;
+		}
+		*value++ = '\0';
+		if (strcmp(word, "rom") == 0) rom = value;
+		else if (strcmp(word, "load") == 0) load_addr = hextoint(value);
+		else if (strcmp(word, "a") == 0) job->a = hextoint(value);
+		else if (strcmp(word, "x") == 0) job->x = hextoint(value);
+		else if (strcmp(word, "y") == 0) job->y = hextoint(value);
+		else if (strcmp(word, "s") == 0) job->sp = hextoint(value);
+		else if (strcmp(word, "p") == 0) job->sr = hextoint(value);
+		else if (strcmp(word, "r") == 0) job->pc = hextoint(value);
+		else if (strcmp(word, "cycles") == 0) job->cycles = strtoull(value, NULL, 10);
+		else if (strcmp(word, "input") == 0) input = value;
+		else if (strcmp(word, "output") == 0) job->output = strdup(value);
+		else if (strcmp(word, "break") == 0) job->break_pc = hextoint(value);
+		else if (strcmp(word, "stuck") == 0) job->stuck_limit = atol(value);
+		else if (strcmp(word, "name") == 0) job->name = strdup(value);
+		else if (strcmp(word, "patch") == 0) {
+			if (parse_patch(job, value) != 0) {
+				fprintf(stderr, "Error: manifest line %d: bad patch, expected ADDR:HEXBYTES\n", job->line);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "Error: manifest line %d: unknown key \"%s\"\n", job->line, word);
+			return -1;
+		}
+	}
+	if (rom == NULL) {
+		fprintf(stderr, "Error: manifest line %d: no rom\n", job->line);
+		return -1;
+	}
+	if (load_addr < 0 || load_addr >= MEMORY_SIZE || (job->image = get_image(rom, load_addr)) == NULL) {
+		fprintf(stderr, "Error: manifest line %d: could not load \"%s\"\n", job->line, rom);
+		return -1;
+	}
+	if (input && (job->input = get_script(input)) == NULL) {
+		fprintf(stderr, "Error: manifest line %d: could not read \"%s\"\n", job->line, input);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_manifest(char * path, uint64_t cycles)
+{
+	char line[4096];
+	FILE * fp;
+	Job * grown;
+	int n = 0;
+
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: could not open \"%s\"\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		n++;
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#') continue;
+		grown = realloc(jobs, (num_jobs + 1) * sizeof(Job));
+		if (grown == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			return -1;
+		}
+		jobs = grown;
+		if (parse_job(&jobs[num_jobs], n, line, cycles) != 0) return -1;
+		num_jobs++;
+	}
+	if (fp != stdin) fclose(fp);
+	return 0;
+}
+
+/* Results */
+
+static void write_string(FILE * fp, const char * s, size_t len) // as a JSON string
+{
+	size_t i;
+
+	putc('"', fp);
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+		else if (c == '\n') fputs("\\n", fp);
+		else if (c == '\r') fputs("\\r", fp);
+		else if (c < 0x20 || c >= 0x7F) fprintf(fp, "\\u%04x", c); // the guest's bytes, not UTF-8
+		else putc(c, fp);
+	}
+	putc('"', fp);
+}
+
+static void write_result(Job * job, CPU * cpu, const char * status, // status is an error message when cpu is NULL
+		 double seconds, int64_t lockstep_steps, const char * output, size_t output_size)
+{
+	pthread_mutex_lock(&results_lock);
+	fprintf(results, "{\"job\": %d, ", job->line);
+	if (job->name) {
+		fputs("\"name\": ", results);
+		write_string(results, job->name, strlen(job->name));
+		fputs(", ", results);
+	}
+	if (cpu == NULL) fprintf(results, "\"status\": \"error\", \"error\": \"%s\"", status);
+	else fprintf(results, "\"status\": \"%s\"", status);
+	if (cpu) {
+		fprintf(results, ", \"cycles\": %llu, \"seconds\": %.6f, \"pc\": %d, \"a\": %d, \"x\": %d, \"y\": %d, \"sp\": %d, \"p\": %d",
+			(unsigned long long)cpu->total_cycles, seconds, cpu->PC, cpu->A, cpu->X, cpu->Y, cpu->SP, get_sr(cpu));
+	}
+	if (cpu && lockstep_steps >= 0) fprintf(results, ", \"lockstep_steps\": %lld", (long long)lockstep_steps);
+	if (output) {
+		fputs(", \"output\": ", results);
+		write_string(results, output, output_size);
+	}
+	fputs("}\n", results);
+	fflush(results);
+	if (cpu == NULL) num_errors++;
+	pthread_mutex_unlock(&results_lock);
+}
+
+/* Jobs */
+
+typedef struct { // a job's machine while it runs
+	CPU * cpu;
+	Uart uart;
+	FILE * output;
+	char * captured; // output=- collects here
+	size_t captured_size;
+} Machine;
+
+static int start_machine(Job * job, Machine * m, bool engines) // -1 (with the error written out) if it can't
+{
+	uint8_t * memory;
+	int i;
+
+	m->captured = NULL;
+	m->captured_size = 0;
+	if (job->output == NULL) m->output = fopen("/dev/null", "w");
+	else if (strcmp(job->output, "-") == 0) m->output = open_memstream(&m->captured, &m->captured_size);
+	else m->output = fopen(job->output, "w");
+	if (m->output == NULL) {
+		write_result(job, NULL, "could not open the output", 0, -1, NULL, 0);
+		return -1;
+	}
+	m->cpu = calloc(1, sizeof(CPU));
+	memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, job->image->fd, 0);
+	if (m->cpu == NULL || memory == MAP_FAILED) {
+		if (memory != MAP_FAILED) munmap(memory, MEMORY_SIZE);
+		free(m->cpu);
+		fclose(m->output);
+		free(m->captured);
+		write_result(job, NULL, "out of memory", 0, -1, NULL, 0);
+		return -1;
+	}
+	init_bus(m->cpu);
+	use_memory(m->cpu, memory);
+	for (i = 0; i < job->num_patches; i++)
+		memcpy(&m->cpu->memory[job->patches[i].addr], job->patches[i].bytes, job->patches[i].size);
+	if (job->input) init_uart_script(&m->uart, m->cpu, job->input->data, job->input->size, m->output);
+	else init_uart_script(&m->uart, m->cpu, NULL, 0, m->output);
+	if (engines) { // these only make the run faster; without them it just runs interpreted
+		if (use_idle) init_idle(m->cpu);
+		if (use_cache) init_block_cache(m->cpu);
+		if (use_jit) init_jit(m->cpu);
+		if (use_hle) init_hle(m->cpu, 0, false);
+	}
+
+	reset_cpu(m->cpu, job->a, job->x, job->y, job->sp, job->sr, job->pc);
+	m->cpu->run_flags = (job->break_pc >= 0 ? RUN_BREAK : 0) | (job->stuck_limit > 0 ? RUN_STUCK : 0);
+	m->cpu->break_pc = job->break_pc;
+	m->cpu->stuck_limit = job->stuck_limit;
+	return 0;
+}
+
+static void finish_machine(Job * job, Machine * m, int why, double seconds, int64_t lockstep_steps)
+{
+	CPU * cpu = m->cpu;
+
+	fflush(m->output);
+	write_result(job, cpu, why == RUN_BREAK ? "break" : why == RUN_STUCK ? "stuck" : "done", seconds, lockstep_steps,
+		m->captured, m->captured_size);
+	fclose(m->output);
+	free(m->captured);
+	free_jit(cpu);
+	free_block_cache(cpu);
+	free_idle(cpu);
+	free_hle(cpu);
+	free_state(cpu);
+	free(cpu);
+}
+
+static void run_job(Job * job)
+{
+	Machine m;
+	double seconds;
+	int why;
+
+	if (start_machine(job, &m, true) != 0) return;
+	seconds = now_seconds();
+	why = run_cycles(m.cpu, job->cycles ? job->cycles : UINT64_MAX);
+	finish_machine(job, &m, why, now_seconds() - seconds, -1);
+}
+
+static void run_lanes(Job ** group, int count) // jobs run_lockstep can take together
+{
+	Machine * m = calloc(count, sizeof(Machine));
+	Job * started[LOCKSTEP_LANES];
+	CPU * cpus[LOCKSTEP_LANES];
+	uint64_t steps[LOCKSTEP_LANES];
+	int why[LOCKSTEP_LANES];
+	int i, n = 0;
+	double seconds;
+
+	if (m == NULL) {
+		for (i = 0; i < count; i++) run_job(group[i]);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (start_machine(group[i], &m[n], false) != 0) continue;
+		started[n] = group[i];
+		cpus[n] = m[n].cpu;
+		n++;
+	}
+	seconds = now_seconds();
+	run_lockstep(cpus, n, group[0]->cycles ? group[0]->cycles : UINT64_MAX, why, steps);
+	seconds = now_seconds() - seconds;
+	for (i = 0; i < n; i++)
+		finish_machine(started[i], &m[i], why[i], seconds, steps[i]);
+	free(m);
+}
+
+static void run_batch(Batch * batch)
+{
+	if (batch->count == 1) run_job(batch->jobs[0]);
+	else run_lanes(batch->jobs, batch->count);
+}
+
+static bool same_lanes(Job * a, Job * b) // could start out in lockstep
+{
+	return a->image == b->image && a->cycles == b->cycles && a->pc == b->pc
+		&& a->break_pc == b->break_pc && a->stuck_limit == b->stuck_limit;
+}
+
+static int make_batches(bool lockstep) // groups compatible jobs when lockstep is set
+{
+	bool * taken = calloc(num_jobs, sizeof(bool));
+	Job ** order = malloc(num_jobs * sizeof(Job *));
+	int i, j, count, n = 0;
+
+	batches = malloc(num_jobs * sizeof(Batch));
+	if (taken == NULL || order == NULL || batches == NULL) return -1;
+	for (i = 0; i < num_jobs; i++) {
+		if (taken[i]) continue;
+		batches[num_batches] = (Batch) { &order[n], 1 };
+		order[n++] = &jobs[i];
+		for (j = i + 1; lockstep && j < num_jobs && batches[num_batches].count < LOCKSTEP_LANES; j++) {
+			if (taken[j] || !same_lanes(&jobs[i], &jobs[j])) continue;
+			taken[j] = true;
+			order[n++] = &jobs[j];
+			batches[num_batches].count++;
+		}
+		count = batches[num_batches].count;
+		if (count < LOCKSTEP_MIN_LANES) { // too few to gain from lockstep, so one by one
+			for (j = 0; j < count; j++)
+				batches[num_batches++] = (Batch) { &order[n - count + j], 1 };
+		} else {
+			num_batches++;
+		}
+	}
+	free(taken);
+	return 0;
+}
+
+/* Work Stealing */
+
+static int take_batch(int self) // the next batch for worker self, or -1 once there are none left anywhere
+{
+	Deque * deque;
+	int i, batch = -1;
+
+	deque = &deques[self];
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head < deque->tail) batch = deque->head++;
+	pthread_mutex_unlock(&deque->lock);
+
+	for (i = 1; batch < 0 && i < num_workers; i++) {
+		deque = &deques[(self + i) % num_workers];
+		pthread_mutex_lock(&deque->lock);
+		if (deque->head < deque->tail) batch = --deque->tail;
+		pthread_mutex_unlock(&deque->lock);
+	}
+	return batch;
+}
+
+static void * worker(void * arg)
+{
+	int self = (intptr_t)arg;
+	int batch;
+
+	while ((batch = take_batch(self)) >= 0)
+		run_batch(&batches[batch]);
+	return NULL;
+}
+
+/* Main */
+
+void usage(char *argv[]) {
+	fprintf(stderr, "Usage: %s [OPTIONS] MANIFEST\n"
+		"Run every job in MANIFEST (- for stdin) on its own machine, in parallel,\n"
+		"and write one JSON record per job as it finishes\n"
+		"\nMANIFEST lines (only rom is required; values in hex except the counts):\n"
+		"	rom=FILE load=ADDR a=HEX x=HEX y=HEX s=HEX p=HEX r=ADDR cycles=NUM\n"
+		"	input=FILE output=FILE|- patch=ADDR:HEXBYTES break=ADDR stuck=NUM\n"
+		"	name=TEXT\n"
+		"\nOPTIONS:\n"
+		"	-j NUM	worker threads (default: one per online core)\n"
+		"	-o FILE	write the records to FILE instead of stdout\n"
+		"	-c NUM	cycles for jobs without cycles= (default %d, 0 for no limit)\n"
+		"	-I	run loops that only poll a device instruction by instruction\n"
+		"	-B	cache predecoded basic blocks\n"
+		"	-J	compile hot code to native x86-64\n"
+		"	-H	run known ROM routines as native code (see 6502-emu -H)\n"
+		"	-V	run jobs with the same ROM, start address, cycles, break and\n"
+		"		stuck settings %d at a time in lockstep, sharing each decoded\n"
+		"		instruction while they agree on the PC (idle loop skipping,\n"
+		"		-B, -J and -H don't apply to them); groups of fewer than %d\n"
+		"		run one by one as usual\n"
+		, argv[0], FLEET_CYCLES, LOCKSTEP_LANES, LOCKSTEP_MIN_LANES);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[MAX_WORKERS];
+	uint64_t cycles = FLEET_CYCLES;
+	char * results_path = NULL;
+	bool lockstep = false;
+	int opt, i;
+
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "hIBJHVj:o:c:")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_workers = atoi(optarg);
+			break;
+		case 'o':
+			results_path = optarg;
+			break;
+		case 'c':
+			cycles = strtoull(optarg, NULL, 10);
+			break;
+		case 'I':
+			use_idle = 0;
+			break;
+		case 'B':
+			use_cache = 1;
+			break;
+		case 'J':
+			use_jit = 1;
+			break;
+		case 'H':
+			use_hle = 1;
+			break;
+		case 'V':
+			lockstep = true;
+			break;
+		case 'h':
+		default: /* '?' */
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (use_cache && use_jit) {
+	   fprintf(stderr, "Error: -B and -J can't be combined\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (optind != argc - 1) {
+	   fprintf(stderr, "Error: expected a manifest\n\n");
+	   usage(argv);
+	   exit(EXIT_FAILURE);
+	}
+	if (read_manifest(argv[optind], cycles) != 0) return EXIT_FAILURE;
+	if (make_batches(lockstep) != 0) {
+		fprintf(stderr, "Error: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	results = results_path ? fopen(results_path, "w") : stdout;
+	if (results == NULL) {
+		fprintf(stderr, "Error: could not open \"%s\"\n", results_path);
+		return EXIT_FAILURE;
+	}
+	if (num_workers > num_batches) num_workers = num_batches;
+	if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+	if (num_workers < 1) num_workers = 1;
+
+	init_tables();
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].head = (long)num_batches * i / num_workers;
+		deques[i].tail = (long)num_batches * (i + 1) / num_workers;
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i) != 0) {
+			if (i == 0) {
+				fprintf(stderr, "Error: could not start a worker thread\n");
+				return EXIT_FAILURE;
+			}
+			break; // the ones that started steal the rest
+		}
+	}
+	while (--i >= 0)
+		pthread_join(threads[i], NULL);
+	if (results != stdout) fclose(results);
+	return num_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
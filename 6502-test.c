@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "6502.h"
+#include "cache.h"
+#include "jit.h"
+#include "trace.h"
+
+// Runs the regression ROMs in-process, one job per thread, each on its own
+// machine. nestest is compared against its reference log as it runs rather
+// than through a trace file and compare.py, and the functional test runs
+// until it traps instead of for a fixed number of cycles.
+
+#define TRAP_STEPS 4 // steps at the same PC that count as a trap (jmp * or a branch to itself)
+#define FUNCTIONAL_MAX_CYCLES 1000000000 // give up on a functional test that never traps
+#define REPORT_SIZE 1024
+
+enum { ENGINE_INTERP, ENGINE_CACHE, ENGINE_JIT };
+enum { SKIP, PASS, FAIL };
+
+typedef struct Job {
+	const char * name;
+	const char * rom;
+	int load_addr;
+	int pc;
+	int engine;
+	int (*run)(struct Job * job, CPU * cpu); // returns PASS or FAIL and fills in report
+	const char * log; // reference trace for run_nestest
+	uint16_t success; // trap address that means run_functional passed
+
+	int result;
+	double seconds;
+	char report[REPORT_SIZE];
+} Job;
+
+static int run_nestest(Job * job, CPU * cpu);
+static int run_functional(Job * job, CPU * cpu);
+
+static Job jobs[] = {
+	{ "nestest", "test/nestest-real-6502.rom", 0xC000, 0xC000, ENGINE_INTERP, run_nestest, "test/nestest-real-6502.log" },
+	{ "functional", "test/6502_functional_test+decimal.bin", 0x000A, 0x1000, ENGINE_INTERP, run_functional, NULL, 0x3CD0 },
+	{ "functional-B", "test/6502_functional_test+decimal.bin", 0x000A, 0x1000, ENGINE_CACHE, run_functional, NULL, 0x3CD0 },
+	{ "functional-J", "test/6502_functional_test+decimal.bin", 0x000A, 0x1000, ENGINE_JIT, run_functional, NULL, 0x3CD0 },
+};
+
+#define NUM_JOBS (int)(sizeof(jobs) / sizeof(jobs[0]))
+
+static bool selected[NUM_JOBS];
+static int next_job; // shared by the workers
+
+static double now_seconds(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / ONE_SECOND;
+}
+
+/* Jobs */
+
+static void chomp(char * line)
+{
+	line[strcspn(line, "\r\n")] = '\0';
+}
+
+static bool same_columns(const char * a, const char * b, size_t from, size_t to) // a[from:to] == b[from:to] in Python
+{
+	size_t len_a = strlen(a), len_b = strlen(b);
+
+	if (len_a > to) len_a = to;
+	if (len_b > to) len_b = to;
+	if (len_a < from) len_a = from;
+	if (len_b < from) len_b = from;
+	return len_a == len_b && memcmp(a + from, b + from, len_a - from) == 0;
+}
+
+// Same rules as compare.py: the address, bytes and registers have to match,
+// except on lines the log has as some kind of NOP. The log goes on into
+// illegal opcodes, which aren't emulated, so reaching one of those counts as
+// a pass.
+static int run_nestest(Job * job, CPU * cpu)
+{
+	char expected[TRACE_LINE_SIZE * 2], line[TRACE_LINE_SIZE];
+	TraceRecord r;
+	FILE * fp;
+	int n;
+
+	fp = fopen(job->log, "r");
+	if (fp == NULL) {
+		snprintf(job->report, REPORT_SIZE, "could not open %s", job->log);
+		return FAIL;
+	}
+	for (n = 1; fgets(expected, sizeof(expected), fp); n++) {
+		fill_record(cpu, &r);
+		format_record(line, sizeof(line), &r);
+		chomp(expected);
+		chomp(line);
+		if ((!same_columns(line, expected, 0, 19) || !same_columns(line, expected, 48, 81)) && !strstr(expected, "NOP")) {
+			fclose(fp);
+			if (strcmp(instructions[r.bytes[0]].mnemonic, "???") == 0) {
+				snprintf(job->report, REPORT_SIZE, "%d lines match, stopped at the first illegal opcode", n - 1);
+				return PASS;
+			}
+			snprintf(job->report, REPORT_SIZE, "first diff at line %d\n  gen: %s\n  nes: %s", n, line, expected);
+			return FAIL;
+		}
+		step_cpu(cpu, 0);
+	}
+	fclose(fp);
+	snprintf(job->report, REPORT_SIZE, "all %d lines match", n - 1);
+	return PASS;
+}
+
+static int run_functional(Job * job, CPU * cpu)
+{
+	cpu->run_flags = RUN_STUCK;
+	cpu->stuck_limit = TRAP_STEPS;
+	if (run_cycles(cpu, FUNCTIONAL_MAX_CYCLES) != RUN_STUCK) {
+		snprintf(job->report, REPORT_SIZE, "no trap within %d cycles, PC at %04x", FUNCTIONAL_MAX_CYCLES, cpu->PC);
+		return FAIL;
+	}
+	snprintf(job->report, REPORT_SIZE, "%s trap at %04x after %llu cycles", cpu->PC == job->success ? "success" : "failure",
+		cpu->PC, (unsigned long long)cpu->total_cycles);
+	return cpu->PC == job->success ? PASS : FAIL;
+}
+
+static void run_job(Job * job)
+{
+	CPU * cpu;
+	int ok;
+
+	if (access(job->rom, R_OK) != 0 || (job->log && access(job->log, R_OK) != 0)) {
+		snprintf(job->report, REPORT_SIZE, "%s not found", access(job->rom, R_OK) != 0 ? job->rom : job->log);
+		job->result = SKIP;
+		return;
+	}
+	job->result = FAIL;
+	cpu = calloc(1, sizeof(CPU));
+	if (cpu == NULL) {
+		snprintf(job->report, REPORT_SIZE, "out of memory");
+		return;
+	}
+	init_bus(cpu);
+	ok = job->engine == ENGINE_CACHE ? init_block_cache(cpu) == 0 : job->engine == ENGINE_JIT ? init_jit(cpu) == 0 : 1;
+	if (!ok) {
+		snprintf(job->report, REPORT_SIZE, "could not set up the %s", job->engine == ENGINE_JIT ? "JIT" : "block cache");
+	} else if (load_rom(cpu, (char *)job->rom, job->load_addr) != 0) {
+		snprintf(job->report, REPORT_SIZE, "could not load %s", job->rom);
+	} else {
+		reset_cpu(cpu, 0, 0, 0, 0xFD, 0, job->pc);
+		job->seconds = now_seconds();
+		job->result = job->run(job, cpu);
+		job->seconds = now_seconds() - job->seconds;
+	}
+	free_jit(cpu);
+	free_block_cache(cpu);
+	free(cpu);
+}
+
+static void * worker(void * arg)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < NUM_JOBS)
+		if (selected[i]) run_job(&jobs[i]);
+	return NULL;
+}
+
+/* Main */
+
+void usage(char *argv[]) {
+	int i;
+
+	fprintf(stderr, "Usage: %s [OPTIONS] [JOB...]\n"
+		"Run the regression ROMs, one job per thread (from the top of the\n"
+		"repository; jobs whose files are missing are skipped)\n"
+		"\nOPTIONS:\n"
+		"	-j NUM	threads to use (default: one per online core)\n"
+		"\nJOBS (a prefix selects every job that starts with it; default: all):\n"
+		, argv[0]);
+	for (i = 0; i < NUM_JOBS; i++)
+		fprintf(stderr, "	%s\n", jobs[i].name);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char * results[] = { "SKIP", "PASS", "FAIL" };
+	pthread_t threads[NUM_JOBS];
+	int num_threads, num_selected, failed, opt, i, j;
+	double seconds;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "hj:")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		case 'h':
+		default: /* '?' */
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+	num_selected = 0;
+	for (i = 0; i < NUM_JOBS; i++) {
+		selected[i] = optind == argc;
+		for (j = optind; j < argc; j++)
+			if (strncmp(jobs[i].name, argv[j], strlen(argv[j])) == 0) selected[i] = true;
+		num_selected += selected[i];
+	}
+	if (num_selected == 0) {
+		fprintf(stderr, "Error: no job matches\n\n");
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+	if (num_threads > num_selected) num_threads = num_selected;
+	if (num_threads < 1) num_threads = 1;
+
+	init_tables();
+	seconds = now_seconds();
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+			if (i == 0) {
+				fprintf(stderr, "Error: could not start a worker thread\n");
+				return EXIT_FAILURE;
+			}
+			num_threads = i; // make do with the ones that started
+			break;
+		}
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	seconds = now_seconds() - seconds;
+
+	failed = 0;
+	for (i = 0; i < NUM_JOBS; i++) {
+		if (!selected[i]) continue;
+		if (jobs[i].result == SKIP)
+			printf("%s %-14s %s\n", results[jobs[i].result], jobs[i].name, jobs[i].report);
+		else
+			printf("%s %-14s %6.2fs  %s\n", results[jobs[i].result], jobs[i].name, jobs[i].seconds, jobs[i].report);
+		failed += jobs[i].result == FAIL;
+	}
+	printf("%d of %d jobs failed in %.2fs on %d threads\n", failed, num_selected, seconds, num_threads);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,353 +3,486 @@
 #include <stdlib.h>
 
 #include "6502.h"
+#include "cache.h"
+#include "jit.h"
+#include "trace.h"
+#include "dump.h"
+#include "profile.h"
+#include "stats.h"
+#include "idle.h"
+#include "hle.h"
 
-uint8_t memory[1<<16];
-uint8_t A;
-uint8_t X;
-uint8_t Y;
-uint16_t PC;
-uint8_t SP;
-uint8_t extra_cycles;
-uint64_t total_cycles;
-union StatusReg SR;
-
-int lengths[NUM_MODES]; // instruction length table, indexed by addressing mode
-uint8_t * (*get_ptr[NUM_MODES])(); // addressing mode decoder table
 Instruction instructions[0x100]; // instruction data table
-Instruction inst; // the current instruction (used for convenience)
-int jumping; // used to check that we don't need to increment the PC after a jump
-void * read_addr;
-void * write_addr;
 
-/* Flag Checks */
+/* Memory Bus */
 
-static inline void N_flag(int8_t val)
+static inline uint8_t bus_read(CPU * cpu, uint16_t addr)
 {
-	SR.bits.sign = val < 0;
+	Page * page = &cpu->pages[addr >> 8];
+	uint8_t val;
+
+	if (page->read) return page->read[addr & 0xFF];
+	val = page->read_handler(page->device, addr);
+	if (cpu->idle) idle_poll(cpu, addr, val);
+	return val;
+}
+
+static inline void bus_write(CPU * cpu, uint16_t addr, uint8_t val)
+{
+	Page * page = &cpu->pages[addr >> 8];
+	if (page->write) page->write[addr & 0xFF] = val;
+	else page->write_handler(page->device, addr, val);
 }
 
-static inline void Z_flag(uint8_t val)
+static inline uint16_t read_pointer(CPU * cpu, uint16_t addr)
 {
-	SR.bits.zero = val == 0;
+	// the high byte never comes from the next page, so ($ff),Y and
+	// JMP ($xxff) wrap around like they do on the real chip
+	return bus_read(cpu, addr) | bus_read(cpu, (addr & 0xff00) | ((addr + 1) & 0xff)) << 8;
 }
 
+/* Addressing Implementations */
+
+static uint16_t get_IMPL(CPU * cpu)
+{
+	// dummy implementation; for completeness necessary for cycle counting NOP
+	// instructions
+	return 0;
+}
+
+static uint16_t get_IMM(CPU * cpu)
+{
+	return cpu->PC+1;
+}
+
+static uint16_t get_RESOLVED(CPU * cpu)
+{
+	return cpu->resolved;
+}
+
+static uint16_t get_uint16(CPU * cpu)
+{ // used only as part of other modes
+	uint16_t index;
+	memcpy(&index, &cpu->memory[get_IMM(cpu)], sizeof(index)); // hooray for optimising compilers
+	return index;
+}
+
+static uint16_t get_ZP(CPU * cpu)
+{
+	return cpu->memory[get_IMM(cpu)];
+}
+
+static uint16_t get_ZPX(CPU * cpu)
+{
+	return (cpu->memory[get_IMM(cpu)] + cpu->X) & 0xFF;
+}
+
+static uint16_t get_ZPY(CPU * cpu)
+{
+	return (cpu->memory[get_IMM(cpu)] + cpu->Y) & 0xFF;
+}
+
+static uint16_t get_ACC(CPU * cpu)
+{
+	// the accumulator has no address; read_op and write_op deal with it
+	return 0;
+}
+
+static uint16_t get_ABS(CPU * cpu)
+{
+	return get_uint16(cpu);
+}
+
+static uint16_t get_ABSX(CPU * cpu)
+{
+	uint16_t ptr;
+	ptr = (uint16_t)(get_uint16(cpu) + cpu->X);
+	if ((uint8_t)ptr < cpu->X) cpu->extra_cycles ++;
+	return ptr;
+}
+
+static uint16_t get_ABSY(CPU * cpu)
+{
+	uint16_t ptr;
+	ptr = (uint16_t)(get_uint16(cpu) + cpu->Y);
+	if ((uint8_t)ptr < cpu->Y) cpu->extra_cycles ++;
+	return ptr;
+}
+
+static uint16_t get_IND(CPU * cpu)
+{
+	uint16_t ptr = get_ABS(cpu);
+	return bus_read(cpu, ptr) | bus_read(cpu, (uint16_t)(ptr + 1)) << 8;
+}
+
+static uint16_t get_XIND(CPU * cpu)
+{
+	return read_pointer(cpu, get_ZPX(cpu));
+}
+
+static uint16_t get_INDY(CPU * cpu)
+{
+	uint16_t ptr;
+	ptr = read_pointer(cpu, get_ZP(cpu));
+	ptr += cpu->Y;
+	if ((uint8_t)ptr < cpu->Y) cpu->extra_cycles ++;
+	return ptr;
+}
+
+static uint16_t get_REL(CPU * cpu)
+{
+	return cpu->PC + (int8_t) cpu->memory[get_IMM(cpu)];
+}
+
+static uint16_t get_JMP_IND_BUG(CPU * cpu)
+{
+	// Bug when crosses a page boundary. When using relative index ($xxff),
+	// instead of using the last byte of the page and the first byte of the
+	// next page, it uses the first byte of the same page. E.g. jmp ($baff)
+	// would use the value at $baff as the LSB, but $ba00 as the high byte
+	// instead of $bb00. This was fixed in the 65C02
+	return read_pointer(cpu, get_uint16(cpu));
+}
+
+/* Addressing Mode Tables */
+// these are constant so that the threaded interpreter can fold them away
+
+const int lengths[NUM_MODES] = { // instruction length table, indexed by addressing mode
+	[ACC]	= 1,
+	[ABS]	= 3,
+	[ABSX]	= 3,
+	[ABSY]	= 3,
+	[IMM]	= 2,
+	[IMPL]	= 1,
+	[IND]	= 3,
+	[XIND]	= 2,
+	[INDY]	= 2,
+	[REL]	= 2,
+	[ZP]	= 2,
+	[ZPX]	= 2,
+	[ZPY]	= 2,
+	[JMP_IND_BUG] = 3,
+	[RESOLVED] = 0, // the block cache keeps the real length
+};
+
+static uint16_t (* const get_addr[NUM_MODES])(CPU * cpu) = { // addressing mode decoder table
+	[ACC]	= get_ACC,
+	[ABS]	= get_ABS,
+	[ABSX]	= get_ABSX,
+	[ABSY]	= get_ABSY,
+	[IMM]	= get_IMM,
+	[IMPL]	= get_IMPL,
+	[IND]	= get_IND,
+	[XIND]	= get_XIND,
+	[INDY]	= get_INDY,
+	[REL]	= get_REL,
+	[ZP]	= get_ZP,
+	[ZPX]	= get_ZPX,
+	[ZPY]	= get_ZPY,
+	[JMP_IND_BUG] = get_JMP_IND_BUG,
+	[RESOLVED] = get_RESOLVED,
+};
+
 /* Stack Helpers */
 
-static inline void stack_push(uint8_t val)
+static inline void stack_push(CPU * cpu, uint8_t val)
 {
-	memory[0x100+(SP--)] = val;
+	bus_write(cpu, 0x100+(cpu->SP--), val);
 }
 
-static inline uint8_t stack_pull()
+static inline uint8_t stack_pull(CPU * cpu)
 {
-	return memory[0x100+(++SP)];
+	return bus_read(cpu, 0x100+(++cpu->SP));
 }
 
 /* Memory read/write wrappers */
 
-static inline uint8_t * read_ptr()
+static inline uint8_t read_op(CPU * cpu, Mode mode)
 {
-	return read_addr = get_ptr[inst.mode]();
+	if (mode == ACC) return cpu->A;
+	return bus_read(cpu, get_addr[mode](cpu));
 }
 
-static inline uint8_t * write_ptr()
+static inline void write_op(CPU * cpu, Mode mode, uint8_t val)
 {
-	return write_addr = get_ptr[inst.mode]();
+	if (mode == ACC) cpu->A = val;
+	else bus_write(cpu, get_addr[mode](cpu), val);
 }
 
 /* Branch logic common to all branch instructions */
 
-static inline void take_branch()
+static inline void take_branch(CPU * cpu, Mode mode)
 {
 	uint16_t oldPC;
-	oldPC = PC + 2; // PC has already moved to point to the next instruction
-	PC = read_ptr() - memory;
-	if ((PC ^ oldPC) & 0xff00) extra_cycles += 1; // addr crosses page boundary
-	extra_cycles += 1;
+	oldPC = cpu->PC + 2; // PC has already moved to point to the next instruction
+	cpu->PC = get_addr[mode](cpu);
+	if ((cpu->PC ^ oldPC) & 0xff00) cpu->extra_cycles += 1; // addr crosses page boundary
+	cpu->extra_cycles += 1;
 }
 
 /* Instruction Implementations */
 
-static void inst_ADC()
+static void inst_ADC(CPU * cpu, Mode mode)
 {
-	uint8_t operand = * read_ptr();
-	unsigned int tmp = A + operand + (SR.bits.carry & 1);
-	if (SR.bits.decimal) {
-		tmp = (A & 0x0f) + (operand & 0x0f) + (SR.bits.carry & 1);
+	uint8_t operand = read_op(cpu, mode);
+	unsigned int tmp = cpu->A + operand + cpu->carry;
+	if (cpu->SR.bits.decimal) {
+		tmp = (cpu->A & 0x0f) + (operand & 0x0f) + cpu->carry;
 		if (tmp >= 10) tmp = (tmp - 10) | 0x10;
-		tmp += (A & 0xf0) + (operand & 0xf0);
+		tmp += (cpu->A & 0xf0) + (operand & 0xf0);
 		if (tmp > 0x9f) tmp += 0x60;
 	}
-	SR.bits.carry = tmp > 0xFF;
-	SR.bits.overflow =  ((A^tmp)&(operand^tmp)&0x80) != 0;
-	A = tmp & 0xFF;
-	N_flag(A);
-	Z_flag(A);
+	cpu->carry = tmp > 0xFF;
+	cpu->v = (cpu->A^tmp)&(operand^tmp);
+	cpu->A = tmp & 0xFF;
+	cpu->nz = cpu->A;
 }
 
-static void inst_AND()
+static void inst_AND(CPU * cpu, Mode mode)
 {
-	A &= * read_ptr();
-	N_flag(A);
-	Z_flag(A);
+	cpu->A &= read_op(cpu, mode);
+	cpu->nz = cpu->A;
 }
 
-static void inst_ASL()
+static void inst_ASL(CPU * cpu, Mode mode)
 {
-	uint8_t tmp = * read_ptr();
-	SR.bits.carry = (tmp & 0x80) != 0;
+	uint8_t tmp = read_op(cpu, mode);
+	cpu->carry = tmp >> 7;
 	tmp <<= 1;
-	N_flag(tmp);
-	Z_flag(tmp);
-	* write_ptr() = tmp;
+	cpu->nz = tmp;
+	write_op(cpu, mode, tmp);
 }
 
-static void inst_BCC()
+static void inst_BCC(CPU * cpu, Mode mode)
 {
-	if (!SR.bits.carry) {
-		take_branch();
+	if (!cpu->carry) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BCS()
+static void inst_BCS(CPU * cpu, Mode mode)
 {
-	if (SR.bits.carry) {
-		take_branch();
+	if (cpu->carry) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BEQ()
+static void inst_BEQ(CPU * cpu, Mode mode)
 {
-	if (SR.bits.zero) {
-		take_branch();
+	if (ZERO(cpu)) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BIT()
+static void inst_BIT(CPU * cpu, Mode mode)
 {
-	uint8_t tmp = * read_ptr();
-	N_flag(tmp);
-	Z_flag(tmp & A);
-	SR.bits.overflow = (tmp & 0x40) != 0;
+	uint8_t tmp = read_op(cpu, mode);
+	cpu->nz = (tmp & cpu->A) | (tmp & 0x80) << 1; // N comes from the operand, not the result
+	cpu->v = tmp << 1;
 }
 
-static void inst_BMI()
+static void inst_BMI(CPU * cpu, Mode mode)
 {
-	if (SR.bits.sign) {
-		take_branch();
+	if (SIGN(cpu)) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BNE()
+static void inst_BNE(CPU * cpu, Mode mode)
 {
-	if (!SR.bits.zero) {
-		take_branch();
+	if (!ZERO(cpu)) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BPL()
+static void inst_BPL(CPU * cpu, Mode mode)
 {
-	if (!SR.bits.sign) {
-		take_branch();
+	if (!SIGN(cpu)) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BRK()
+static void inst_BRK(CPU * cpu, Mode mode)
 {
 	uint16_t newPC;
-	memcpy(&newPC, &memory[IRQ_VEC], sizeof(newPC));
-	PC += 2;
-	stack_push(PC >> 8);
-	stack_push(PC & 0xFF);
-	SR.bits.brk = 1;
-	stack_push(SR.byte);
-	SR.bits.interrupt = 1;
-	PC = newPC;
-	jumping = 1;
+	memcpy(&newPC, &cpu->memory[IRQ_VEC], sizeof(newPC));
+	cpu->PC += 2;
+	stack_push(cpu, cpu->PC >> 8);
+	stack_push(cpu, cpu->PC & 0xFF);
+	cpu->SR.bits.brk = 1;
+	stack_push(cpu, get_sr(cpu));
+	cpu->SR.bits.interrupt = 1;
+	cpu->PC = newPC;
+	cpu->jumping = 1;
 }
 
-static void inst_BVC()
+static void inst_BVC(CPU * cpu, Mode mode)
 {
-	if (!SR.bits.overflow) {
-		take_branch();
+	if (!OVERFLOW(cpu)) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_BVS()
+static void inst_BVS(CPU * cpu, Mode mode)
 {
-	if (SR.bits.overflow) {
-		take_branch();
+	if (OVERFLOW(cpu)) {
+		take_branch(cpu, mode);
 	}
 }
 
-static void inst_CLC()
+static void inst_CLC(CPU * cpu, Mode mode)
 {
-	SR.bits.carry = 0;
+	cpu->carry = 0;
 }
 
-static void inst_CLD()
+static void inst_CLD(CPU * cpu, Mode mode)
 {
-	SR.bits.decimal = 0;
+	cpu->SR.bits.decimal = 0;
 }
 
-static void inst_CLI()
+static void inst_CLI(CPU * cpu, Mode mode)
 {
-	SR.bits.interrupt = 0;
+	cpu->SR.bits.interrupt = 0;
+	if (cpu->interrupts) cpu->stop = cpu->total_cycles; // a waiting IRQ can be taken now
 }
 
-static void inst_CLV()
+static void inst_CLV(CPU * cpu, Mode mode)
 {
-	SR.bits.overflow = 0;
+	cpu->v = 0;
 }
 
-static void inst_CMP()
+static void inst_CMP(CPU * cpu, Mode mode)
 {
-	uint8_t operand = * read_ptr();
-	uint8_t tmpDiff = A - operand;
-	N_flag(tmpDiff);
-	Z_flag(tmpDiff);
-	SR.bits.carry = A >= operand;
+	uint8_t operand = read_op(cpu, mode);
+	uint8_t tmpDiff = cpu->A - operand;
+	cpu->nz = tmpDiff;
+	cpu->carry = cpu->A >= operand;
 }
 
-static void inst_CPX()
+static void inst_CPX(CPU * cpu, Mode mode)
 {
-	uint8_t operand = * read_ptr();
-	uint8_t tmpDiff = X - operand;
-	N_flag(tmpDiff);
-	Z_flag(tmpDiff);
-	SR.bits.carry = X >= operand;
+	uint8_t operand = read_op(cpu, mode);
+	uint8_t tmpDiff = cpu->X - operand;
+	cpu->nz = tmpDiff;
+	cpu->carry = cpu->X >= operand;
 }
 
-static void inst_CPY()
+static void inst_CPY(CPU * cpu, Mode mode)
 {
-	uint8_t operand = * read_ptr();
-	uint8_t tmpDiff = Y - operand;
-	N_flag(tmpDiff);
-	Z_flag(tmpDiff);
-	SR.bits.carry = Y >= operand;
+	uint8_t operand = read_op(cpu, mode);
+	uint8_t tmpDiff = cpu->Y - operand;
+	cpu->nz = tmpDiff;
+	cpu->carry = cpu->Y >= operand;
 }
 
-static void inst_DEC()
+static void inst_DEC(CPU * cpu, Mode mode)
 {
-	uint8_t tmp = * read_ptr();
+	uint8_t tmp = read_op(cpu, mode);
 	tmp--;
-	N_flag(tmp);
-	Z_flag(tmp);
-	* write_ptr() = tmp;
+	cpu->nz = tmp;
+	write_op(cpu, mode, tmp);
 }
 
-static void inst_DEX()
+static void inst_DEX(CPU * cpu, Mode mode)
 {
-	X--;
-	N_flag(X);
-	Z_flag(X);
+	cpu->X--;
+	cpu->nz = cpu->X;
 }
 
-static void inst_DEY()
+static void inst_DEY(CPU * cpu, Mode mode)
 {
-	Y--;
-	N_flag(Y);
-	Z_flag(Y);
+	cpu->Y--;
+	cpu->nz = cpu->Y;
 }
 
-static void inst_EOR()
+static void inst_EOR(CPU * cpu, Mode mode)
 {
-	A ^= * read_ptr();
-	N_flag(A);
-	Z_flag(A);
+	cpu->A ^= read_op(cpu, mode);
+	cpu->nz = cpu->A;
 }
 
-static void inst_INC()
+static void inst_INC(CPU * cpu, Mode mode)
 {
-	uint8_t tmp = * read_ptr();
+	uint8_t tmp = read_op(cpu, mode);
 	tmp++;
-	N_flag(tmp);
-	Z_flag(tmp);
-	* write_ptr() = tmp;
+	cpu->nz = tmp;
+	write_op(cpu, mode, tmp);
 }
 
-static void inst_INX()
+static void inst_INX(CPU * cpu, Mode mode)
 {
-	X++;
-	N_flag(X);
-	Z_flag(X);
+	cpu->X++;
+	cpu->nz = cpu->X;
 }
 
-static void inst_INY()
+static void inst_INY(CPU * cpu, Mode mode)
 {
-	Y++;
-	N_flag(Y);
-	Z_flag(Y);
+	cpu->Y++;
+	cpu->nz = cpu->Y;
 }
 
-static void inst_JMP()
+static void inst_JMP(CPU * cpu, Mode mode)
 {
-	PC = read_ptr() - memory;
-	jumping = 1;
+	cpu->PC = get_addr[mode](cpu);
+	cpu->jumping = 1;
 }
 
-static void inst_JSR()
+static void inst_JSR(CPU * cpu, Mode mode)
 {
-	uint16_t newPC = read_ptr() - memory;
-	PC += 2;
-	stack_push(PC >> 8);
-	stack_push(PC & 0xFF);
-	PC = newPC;
-	jumping = 1;
+	uint16_t newPC = get_addr[mode](cpu);
+	cpu->PC += 2;
+	stack_push(cpu, cpu->PC >> 8);
+	stack_push(cpu, cpu->PC & 0xFF);
+	cpu->PC = newPC;
+	cpu->jumping = 1;
 }
 
-static void inst_LDA()
+static void inst_LDA(CPU * cpu, Mode mode)
 {
-	A = * read_ptr();
-	N_flag(A);
-	Z_flag(A);
+	cpu->A = read_op(cpu, mode);
+	cpu->nz = cpu->A;
 }
 
-static void inst_LDX()
+static void inst_LDX(CPU * cpu, Mode mode)
 {
-	X = * read_ptr();
-	N_flag(X);
-	Z_flag(X);
+	cpu->X = read_op(cpu, mode);
+	cpu->nz = cpu->X;
 }
 
-static void inst_LDY()
+static void inst_LDY(CPU * cpu, Mode mode)
 {
-	Y = * read_ptr();
-	N_flag(Y);
-	Z_flag(Y);
+	cpu->Y = read_op(cpu, mode);
+	cpu->nz = cpu->Y;
 }
 
-static void inst_LSR()
+static void inst_LSR(CPU * cpu, Mode mode)
 {
-	uint8_t tmp = * read_ptr();
-	SR.bits.carry = tmp & 1;
+	uint8_t tmp = read_op(cpu, mode);
+	cpu->carry = tmp & 1;
 	tmp >>= 1;
-	N_flag(tmp);
-	Z_flag(tmp);
-	* write_ptr() = tmp;
+	cpu->nz = tmp;
+	write_op(cpu, mode, tmp);
 }
 
-static void inst_NOP()
+static void inst_NOP(CPU * cpu, Mode mode)
 {
 	// thrown away, just used to compute any extra cycles for the multi-byte
 	// NOP statements
-	read_ptr();
+	get_addr[mode](cpu);
 }
 
-static void inst_ORA()
+static void inst_ORA(CPU * cpu, Mode mode)
 {
-	A |= * read_ptr();
-	N_flag(A);
-	Z_flag(A);
+	cpu->A |= read_op(cpu, mode);
+	cpu->nz = cpu->A;
 }
 
-static void inst_PHA()
+static void inst_PHA(CPU * cpu, Mode mode)
 {
-	stack_push(A);
+	stack_push(cpu, cpu->A);
 }
 
-static void inst_PHP()
+static void inst_PHP(CPU * cpu, Mode mode)
 {
 	union StatusReg pushed_sr;
 
@@ -358,604 +491,300 @@ static void inst_PHP()
 	// unexpected, but it's what the real hardware does.
 	//
 	// See http://visual6502.org/wiki/index.php?title=6502_BRK_and_B_bit
-	pushed_sr.byte = SR.byte;
+	pushed_sr.byte = get_sr(cpu);
 	pushed_sr.bits.brk = 1;
-	stack_push(pushed_sr.byte);
+	stack_push(cpu, pushed_sr.byte);
 }
 
-static void inst_PLA()
+static void inst_PLA(CPU * cpu, Mode mode)
 {
-	A = stack_pull();
-	N_flag(A);
-	Z_flag(A);
+	cpu->A = stack_pull(cpu);
+	cpu->nz = cpu->A;
 }
 
-static void inst_PLP()
+static void inst_PLP(CPU * cpu, Mode mode)
 {
-	SR.byte = stack_pull();
-	SR.bits.unused = 1;
-	SR.bits.brk = 0;
+	set_sr(cpu, stack_pull(cpu));
+	cpu->SR.bits.unused = 1;
+	cpu->SR.bits.brk = 0;
+	if (cpu->interrupts) cpu->stop = cpu->total_cycles;
 }
 
-static void inst_ROL()
+static void inst_ROL(CPU * cpu, Mode mode)
 {
-	int tmp = (* read_ptr()) << 1;
-	tmp |= SR.bits.carry & 1;
-	SR.bits.carry = tmp > 0xFF;
+	int tmp = read_op(cpu, mode) << 1;
+	tmp |= cpu->carry;
+	cpu->carry = tmp > 0xFF;
 	tmp &= 0xFF;
-	N_flag(tmp);
-	Z_flag(tmp);
-	* write_ptr() = tmp;
+	cpu->nz = tmp;
+	write_op(cpu, mode, tmp);
 }
 
-static void inst_ROR()
+static void inst_ROR(CPU * cpu, Mode mode)
 {
-	int tmp = * read_ptr();
-	tmp |= SR.bits.carry << 8;
-	SR.bits.carry = tmp & 1;
+	int tmp = read_op(cpu, mode);
+	tmp |= cpu->carry << 8;
+	cpu->carry = tmp & 1;
 	tmp >>= 1;
-	N_flag(tmp);
-	Z_flag(tmp);
-	* write_ptr() = tmp;
+	cpu->nz = tmp;
+	write_op(cpu, mode, tmp);
 }
 
-static void inst_RTI()
+static void inst_RTI(CPU * cpu, Mode mode)
 {
-	SR.byte = stack_pull();
-	SR.bits.unused = 1;
-	PC = stack_pull();
-	PC |= stack_pull() << 8;
+	set_sr(cpu, stack_pull(cpu));
+	cpu->SR.bits.unused = 1;
+	cpu->PC = stack_pull(cpu);
+	cpu->PC |= stack_pull(cpu) << 8;
 	//PC += 1;
-	jumping = 1;
+	cpu->jumping = 1;
+	if (cpu->interrupts) cpu->stop = cpu->total_cycles;
 }
 
-static void inst_RTS()
+static void inst_RTS(CPU * cpu, Mode mode)
 {
-	PC = stack_pull();
-	PC |= stack_pull() << 8;
-	PC += 1;
-	jumping = 1;
+	cpu->PC = stack_pull(cpu);
+	cpu->PC |= stack_pull(cpu) << 8;
+	cpu->PC += 1;
+	cpu->jumping = 1;
 }
 
-static void inst_SBC()
+static void inst_SBC(CPU * cpu, Mode mode)
 {
-	uint8_t operand = * read_ptr();
+	uint8_t operand = read_op(cpu, mode);
 	unsigned int tmp, lo, hi;
-	tmp = A - operand - 1 + (SR.bits.carry & 1);
-	SR.bits.overflow = ((A^tmp)&(A^operand)&0x80) != 0;
-	if (SR.bits.decimal) {
-		lo = (A & 0x0f) - (operand & 0x0f) - 1 + SR.bits.carry;
-		hi = (A >> 4) - (operand >> 4);
+	tmp = cpu->A - operand - 1 + cpu->carry;
+	cpu->v = (cpu->A^tmp)&(cpu->A^operand);
+	if (cpu->SR.bits.decimal) {
+		lo = (cpu->A & 0x0f) - (operand & 0x0f) - 1 + cpu->carry;
+		hi = (cpu->A >> 4) - (operand >> 4);
 		if (lo & 0x10) lo -= 6, hi--;
 		if (hi & 0x10) hi -= 6;
-		A = (hi << 4) | (lo & 0x0f);
+		cpu->A = (hi << 4) | (lo & 0x0f);
 	}
 	else {
-		A = tmp & 0xFF;
+		cpu->A = tmp & 0xFF;
 	}
-	SR.bits.carry = tmp < 0x100;
-	N_flag(A);
-	Z_flag(A);
+	cpu->carry = tmp < 0x100;
+	cpu->nz = cpu->A;
 }
 
-static void inst_SEC()
+static void inst_SEC(CPU * cpu, Mode mode)
 {
-	SR.bits.carry = 1;
+	cpu->carry = 1;
 }
 
-static void inst_SED()
+static void inst_SED(CPU * cpu, Mode mode)
 {
-	SR.bits.decimal = 1;
+	cpu->SR.bits.decimal = 1;
 }
 
-static void inst_SEI()
+static void inst_SEI(CPU * cpu, Mode mode)
 {
-	SR.bits.interrupt = 1;
+	cpu->SR.bits.interrupt = 1;
 }
 
-static void inst_STA()
+static void inst_STA(CPU * cpu, Mode mode)
 {
-	* write_ptr() = A;
-	extra_cycles = 0; // STA has no addressing modes that use the extra cycle
+	write_op(cpu, mode, cpu->A);
+	cpu->extra_cycles = 0; // STA has no addressing modes that use the extra cycle
 }
 
-static void inst_STX()
+static void inst_STX(CPU * cpu, Mode mode)
 {
-	* write_ptr() = X;
+	write_op(cpu, mode, cpu->X);
 }
 
-static void inst_STY()
+static void inst_STY(CPU * cpu, Mode mode)
 {
-	* write_ptr() = Y;
+	write_op(cpu, mode, cpu->Y);
 }
 
-static void inst_TAX()
+static void inst_TAX(CPU * cpu, Mode mode)
 {
-	X = A;
-	N_flag(X);
-	Z_flag(X);
+	cpu->X = cpu->A;
+	cpu->nz = cpu->X;
 }
 
-static void inst_TAY()
+static void inst_TAY(CPU * cpu, Mode mode)
 {
-	Y = A;
-	N_flag(Y);
-	Z_flag(Y);
+	cpu->Y = cpu->A;
+	cpu->nz = cpu->Y;
 }
 
-static void inst_TSX()
+static void inst_TSX(CPU * cpu, Mode mode)
 {
-	X = SP;
-	N_flag(X);
-	Z_flag(X);
+	cpu->X = cpu->SP;
+	cpu->nz = cpu->X;
 }
 
-static void inst_TXA()
+static void inst_TXA(CPU * cpu, Mode mode)
 {
-	A = X;
-	N_flag(A);
-	Z_flag(A);
+	cpu->A = cpu->X;
+	cpu->nz = cpu->A;
 }
 
-static void inst_TXS()
+static void inst_TXS(CPU * cpu, Mode mode)
 {
-	SP = X;
+	cpu->SP = cpu->X;
 }
 
-static void inst_TYA()
+static void inst_TYA(CPU * cpu, Mode mode)
 {
-	A = Y;
-	N_flag(A);
-	Z_flag(A);
+	cpu->A = cpu->Y;
+	cpu->nz = cpu->A;
 }
 
-/* Addressing Implementations */
+/* Fused Pairs */
 
-uint8_t * get_IMPL()
-{
-	// dummy implementation; for completeness necessary for cycle counting NOP
-	// instructions
-	return &memory[0];
-}
+// Each pair in fusions.h gets one handler that runs both instructions with
+// their addressing modes folded in, the way the threaded interpreter stamps
+// out single opcodes, and the block cache calls it in place of the first of
+// the two. The second only runs if the run loop wouldn't have stopped in
+// between and the first didn't overwrite its opcode; its operand is read
+// from memory as it runs, so an overwritten operand is picked up. Each
+// instruction adds its own cycles, so total_cycles is the same either way.
 
-uint8_t * get_IMM()
-{
-	return &memory[(uint16_t) (PC+1)];
-}
+#define FUSED_STEP(op, name, mode, cycles) \
+	cpu->jumping = 0; \
+	cpu->extra_cycles = 0; \
+	inst_##name(cpu, mode); \
+	if (cpu->jumping == 0) cpu->PC += lengths[mode]; \
+	if (cycles == 7) cpu->extra_cycles = 0; \
+	COUNT_STEP(cpu, op); \
+	cpu->total_cycles += cycles + cpu->extra_cycles;
 
-uint16_t get_uint16()
-{ // used only as part of other modes
-	uint16_t index;
-	memcpy(&index, get_IMM(), sizeof(index)); // hooray for optimising compilers
-	return index;
+#define FUSION(op1, name1, mode1, cycles1, op2, name2, mode2, cycles2) \
+static int fused_##op1##_##op2(CPU * cpu) \
+{ \
+	FUSED_STEP(op1, name1, mode1, cycles1) \
+	if (cpu->total_cycles >= cpu->stop || cpu->memory[cpu->PC] != op2 \
+			|| ((cpu->run_flags & RUN_BREAK) && cpu->PC == cpu->break_pc) \
+			|| (cpu->hle && cpu->hle->slots[cpu->PC])) \
+		return 1; \
+	FUSED_STEP(op2, name2, mode2, cycles2) \
+	return 2; \
 }
+#include "fusions.h"
+#undef FUSION
+#undef FUSED_STEP
 
-uint8_t * get_ZP()
-{
-	return &memory[* get_IMM()];
-}
+static const struct {
+	uint8_t first, second;
+	Fusion run;
+} fusions[] = {
+#define FUSION(op1, name1, mode1, cycles1, op2, name2, mode2, cycles2) {op1, op2, fused_##op1##_##op2},
+#include "fusions.h"
+#undef FUSION
+	{0, 0, NULL} // so that fusions.h may be empty
+};
 
-uint8_t * get_ZPX()
+Fusion find_fusion(uint8_t first, uint8_t second) // the handler for a pair, or NULL if it isn't in fusions.h
 {
-	return &memory[((* get_IMM()) + X) & 0xFF];
-}
+	int i;
 
-uint8_t * get_ZPY()
-{
-	return &memory[((* get_IMM()) + Y) & 0xFF];
+	for (i = 0; fusions[i].run; i++)
+		if (fusions[i].first == first && fusions[i].second == second) return fusions[i].run;
+	return NULL;
 }
 
-uint8_t * get_ACC()
-{
-	return &A;
-}
+/* Construction of Tables */
 
-uint8_t * get_ABS()
+void init_tables() // this is only done at runtime to improve code readability.
 {
-	return &memory[get_uint16()];
+#define OPCODE(op, mnemonic, name, mode, cycles) \
+	instructions[op] = (Instruction) {mnemonic, inst_##name, mode, cycles};
+#include "opcodes.h"
+#undef OPCODE
 }
 
-uint8_t * get_ABSX()
-{
-	uint16_t ptr;
-	ptr = (uint16_t)(get_uint16() + X);
-	if ((uint8_t)ptr < X) extra_cycles ++;
-	return &memory[ptr];
-}
+/* Memory Map */
 
-uint8_t * get_ABSY()
+static void ignore_write(void * device, uint16_t addr, uint8_t val)
 {
-	uint16_t ptr;
-	ptr = (uint16_t)(get_uint16() + Y);
-	if ((uint8_t)ptr < Y) extra_cycles ++;
-	return &memory[ptr];
+	// writes to ROM are lost
 }
 
-uint8_t * get_IND()
+static void write_code(void * device, uint16_t addr, uint8_t val)
 {
-	uint16_t ptr;
-	memcpy(&ptr, get_ABS(), sizeof(ptr));
-	return &memory[ptr];
+	CPU * cpu = device;
+	cpu->memory[addr] = val;
+	if (cpu->dump) mark_dirty(cpu, addr);
+	if (cpu->cache) cache_check_write(cpu, addr);
+	if (cpu->jit) jit_check_write(cpu, addr);
 }
 
-uint8_t * get_XIND()
+void init_bus(CPU * cpu) // everything starts out as RAM
 {
-	uint16_t ptr;
-	ptr = ((* get_IMM()) + X) & 0xFF;
-	if (ptr == 0xff) { // check for wraparound in zero page
-		ptr = memory[ptr] + (memory[ptr & 0xff00] << 8);
-	}
-	else {
-		memcpy(&ptr, &memory[ptr], sizeof(ptr));
-	}
-	return &memory[ptr];
+	cpu->memory = cpu->ram;
+	add_device_state(cpu, "interrupts", &cpu->interrupts, sizeof(cpu->interrupts)); // so held IRQ lines survive snapshots
+	map_memory(cpu, 0x00, 0xFF, true);
 }
 
-uint8_t * get_INDY()
+void map_memory(CPU * cpu, uint8_t first, uint8_t last, bool writable) // RAM or ROM backed by memory[]
 {
-	uint16_t ptr;
-	ptr = * get_IMM();
-	if (ptr == 0xff) { // check for wraparound in zero page
-		ptr = memory[ptr] + (memory[ptr & 0xff00] << 8);
-	}
-	else {
-		memcpy(&ptr, &memory[ptr], sizeof(ptr));
+	int i;
+
+	for (i = first; i <= last; i++) {
+		cpu->pages[i] = (Page) {
+			.read = &cpu->memory[i << 8],
+			.write = writable ? &cpu->memory[i << 8] : NULL,
+			.write_handler = ignore_write,
+		};
 	}
-	ptr += Y;
-	if ((uint8_t)ptr < Y) extra_cycles ++;
-	return &memory[ptr];
 }
 
-uint8_t * get_REL()
+void map_device(CPU * cpu, uint8_t page, uint8_t (*read_handler)(void * device, uint16_t addr),
+	void (*write_handler)(void * device, uint16_t addr, uint8_t val), void * device)
 {
-	return &memory[(uint16_t) (PC + (int8_t) * get_IMM())];
+	cpu->pages[page] = (Page) {
+		.read_handler = read_handler,
+		.write_handler = write_handler,
+		.device = device,
+	};
 }
 
-uint8_t * get_JMP_IND_BUG()
+void watch_code(CPU * cpu, uint16_t start, uint32_t end) // sends writes over [start, end) through write_code
 {
-	uint8_t * addr;
-	uint16_t ptr;
-
-	ptr = get_uint16();
-	if ((ptr & 0xff) == 0xff) {
-		// Bug when crosses a page boundary. When using relative index ($xxff),
-		// instead of using the last byte of the page and the first byte of the
-		// next page, it uses the first byte of the same page. E.g. jmp ($baff)
-		// would use the value at $baff as the LSB, but $ba00 as the high byte
-		// instead of $bb00. This was fixed in the 65C02
-		ptr = memory[ptr] + (memory[ptr & 0xff00] << 8);
+	Page * page;
+	uint32_t i;
 
+	for (i = start >> 8; i <= (end - 1) >> 8 && i < 0x100; i++) {
+		page = &cpu->pages[i];
+		if (page->write == NULL) continue; // ROM, devices, or already watched
+		page->write = NULL;
+		page->write_handler = write_code;
+		page->device = cpu;
+		page->watched = true;
 	}
-	else {
-		addr = &memory[ptr];
-		memcpy(&ptr, addr, sizeof(ptr));
-	}
-	return &memory[ptr];
 }
 
-
-/* Construction of Tables */
-
-void init_tables() // this is only done at runtime to improve code readability.
+void reset_cpu(CPU * cpu, int _a, int _x, int _y, int _sp, int _sr, int _pc)
 {
-	/* Instruction Lengths */
-
-	lengths[ACC]	= 1;
-	lengths[ABS]	= 3;
-	lengths[ABSX]	= 3;
-	lengths[ABSY]	= 3;
-	lengths[IMM]	= 2;
-	lengths[IMPL]	= 1;
-	lengths[IND]	= 3;
-	lengths[XIND]	= 2;
-	lengths[INDY]	= 2;
-	lengths[REL]	= 2;
-	lengths[ZP]		= 2;
-	lengths[ZPX]	= 2;
-	lengths[ZPY]	= 2;
-	lengths[JMP_IND_BUG] = 3;
-
-	/* Addressing Modes */
-	
-	get_ptr[ACC]	= get_ACC;
-	get_ptr[ABS]	= get_ABS;
-	get_ptr[ABSX]	= get_ABSX;
-	get_ptr[ABSY]	= get_ABSY;
-	get_ptr[IMM]	= get_IMM;
-	get_ptr[IMPL]	= get_IMPL;
-	get_ptr[IND]	= get_IND;
-	get_ptr[XIND]	= get_XIND;
-	get_ptr[INDY]	= get_INDY;
-	get_ptr[REL]	= get_REL;
-	get_ptr[ZP]	= get_ZP;
-	get_ptr[ZPX]	= get_ZPX;
-	get_ptr[ZPY]	= get_ZPY;
-	get_ptr[JMP_IND_BUG] = get_JMP_IND_BUG;
-
-	/* Instructions */
-	
-	instructions[0x00] = (Instruction) {"BRK impl", inst_BRK, IMPL, 7};
-	instructions[0x01] = (Instruction) {"ORA X,ind", inst_ORA, XIND, 6};
-	instructions[0x02] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x03] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x04] = (Instruction) {"???", inst_NOP, ZP, 3};
-	instructions[0x05] = (Instruction) {"ORA zpg", inst_ORA, ZP, 3};
-	instructions[0x06] = (Instruction) {"ASL zpg", inst_ASL, ZP, 5};
-	instructions[0x07] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x08] = (Instruction) {"PHP impl", inst_PHP, IMPL, 3};
-	instructions[0x09] = (Instruction) {"ORA #", inst_ORA, IMM, 2};
-	instructions[0x0A] = (Instruction) {"ASL A", inst_ASL, ACC, 2};
-	instructions[0x0B] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x0C] = (Instruction) {"???", inst_NOP, ABS, 4};
-	instructions[0x0D] = (Instruction) {"ORA abs", inst_ORA, ABS, 4};
-	instructions[0x0E] = (Instruction) {"ASL abs", inst_ASL, ABS, 6};
-	instructions[0x0F] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x10] = (Instruction) {"BPL rel", inst_BPL, REL, 2};
-	instructions[0x11] = (Instruction) {"ORA ind,Y", inst_ORA, INDY, 5};
-	instructions[0x12] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x13] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x14] = (Instruction) {"???", inst_NOP, ZP, 4};
-	instructions[0x15] = (Instruction) {"ORA zpg,X", inst_ORA, ZPX, 4};
-	instructions[0x16] = (Instruction) {"ASL zpg,X", inst_ASL, ZPX, 6};
-	instructions[0x17] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x18] = (Instruction) {"CLC impl", inst_CLC, IMPL, 2};
-	instructions[0x19] = (Instruction) {"ORA abs,Y", inst_ORA, ABSY, 4};
-	instructions[0x1A] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x1B] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x1C] = (Instruction) {"???", inst_NOP, ABSX, 4};
-	instructions[0x1D] = (Instruction) {"ORA abs,X", inst_ORA, ABSX, 4};
-	instructions[0x1E] = (Instruction) {"ASL abs,X", inst_ASL, ABSX, 7};
-	instructions[0x1F] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x20] = (Instruction) {"JSR abs", inst_JSR, ABS, 6};
-	instructions[0x21] = (Instruction) {"AND X,ind", inst_AND, XIND, 6};
-	instructions[0x22] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x23] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x24] = (Instruction) {"BIT zpg", inst_BIT, ZP, 3};
-	instructions[0x25] = (Instruction) {"AND zpg", inst_AND, ZP, 3};
-	instructions[0x26] = (Instruction) {"ROL zpg", inst_ROL, ZP, 5};
-	instructions[0x27] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x28] = (Instruction) {"PLP impl", inst_PLP, IMPL, 4};
-	instructions[0x29] = (Instruction) {"AND #", inst_AND, IMM, 2};
-	instructions[0x2A] = (Instruction) {"ROL A", inst_ROL, ACC, 2};
-	instructions[0x2B] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x2C] = (Instruction) {"BIT abs", inst_BIT, ABS, 4};
-	instructions[0x2D] = (Instruction) {"AND abs", inst_AND, ABS, 4};
-	instructions[0x2E] = (Instruction) {"ROL abs", inst_ROL, ABS, 6};
-	instructions[0x2F] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x30] = (Instruction) {"BMI rel", inst_BMI, REL, 2};
-	instructions[0x31] = (Instruction) {"AND ind,Y", inst_AND, INDY, 5};
-	instructions[0x32] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x33] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x34] = (Instruction) {"???", inst_NOP, ZP, 4};
-	instructions[0x35] = (Instruction) {"AND zpg,X", inst_AND, ZPX, 4};
-	instructions[0x36] = (Instruction) {"ROL zpg,X", inst_ROL, ZPX, 6};
-	instructions[0x37] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x38] = (Instruction) {"SEC impl", inst_SEC, IMPL, 2};
-	instructions[0x39] = (Instruction) {"AND abs,Y", inst_AND, ABSY, 4};
-	instructions[0x3A] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x3B] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x3C] = (Instruction) {"???", inst_NOP, ABSX, 4};
-	instructions[0x3D] = (Instruction) {"AND abs,X", inst_AND, ABSX, 4};
-	instructions[0x3E] = (Instruction) {"ROL abs,X", inst_ROL, ABSX, 7};
-	instructions[0x3F] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x40] = (Instruction) {"RTI impl", inst_RTI, IMPL, 6};
-	instructions[0x41] = (Instruction) {"EOR X,ind", inst_EOR, XIND, 6};
-	instructions[0x42] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x43] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x44] = (Instruction) {"???", inst_NOP, ZP, 3};
-	instructions[0x45] = (Instruction) {"EOR zpg", inst_EOR, ZP, 3};
-	instructions[0x46] = (Instruction) {"LSR zpg", inst_LSR, ZP, 5};
-	instructions[0x47] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x48] = (Instruction) {"PHA impl", inst_PHA, IMPL, 3};
-	instructions[0x49] = (Instruction) {"EOR #", inst_EOR, IMM, 2};
-	instructions[0x4A] = (Instruction) {"LSR A", inst_LSR, ACC, 2};
-	instructions[0x4B] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x4C] = (Instruction) {"JMP abs", inst_JMP, ABS, 3};
-	instructions[0x4D] = (Instruction) {"EOR abs", inst_EOR, ABS, 4};
-	instructions[0x4E] = (Instruction) {"LSR abs", inst_LSR, ABS, 6};
-	instructions[0x4F] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x50] = (Instruction) {"BVC rel", inst_BVC, REL, 2};
-	instructions[0x51] = (Instruction) {"EOR ind,Y", inst_EOR, INDY, 5};
-	instructions[0x52] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x53] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x54] = (Instruction) {"???", inst_NOP, ZP, 4};
-	instructions[0x55] = (Instruction) {"EOR zpg,X", inst_EOR, ZPX, 4};
-	instructions[0x56] = (Instruction) {"LSR zpg,X", inst_LSR, ZPX, 6};
-	instructions[0x57] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x58] = (Instruction) {"CLI impl", inst_CLI, IMPL, 2};
-	instructions[0x59] = (Instruction) {"EOR abs,Y", inst_EOR, ABSY, 4};
-	instructions[0x5A] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x5B] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x5C] = (Instruction) {"???", inst_NOP, ABSX, 4};
-	instructions[0x5D] = (Instruction) {"EOR abs,X", inst_EOR, ABSX, 4};
-	instructions[0x5E] = (Instruction) {"LSR abs,X", inst_LSR, ABSX, 7};
-	instructions[0x5F] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x60] = (Instruction) {"RTS impl", inst_RTS, IMPL, 6};
-	instructions[0x61] = (Instruction) {"ADC X,ind", inst_ADC, XIND, 6};
-	instructions[0x62] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x63] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x64] = (Instruction) {"???", inst_NOP, ZP, 3};
-	instructions[0x65] = (Instruction) {"ADC zpg", inst_ADC, ZP, 3};
-	instructions[0x66] = (Instruction) {"ROR zpg", inst_ROR, ZP, 5};
-	instructions[0x67] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x68] = (Instruction) {"PLA impl", inst_PLA, IMPL, 4};
-	instructions[0x69] = (Instruction) {"ADC #", inst_ADC, IMM, 2};
-	instructions[0x6A] = (Instruction) {"ROR A", inst_ROR, ACC, 2};
-	instructions[0x6B] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x6C] = (Instruction) {"JMP ind", inst_JMP, JMP_IND_BUG, 5};
-	instructions[0x6D] = (Instruction) {"ADC abs", inst_ADC, ABS, 4};
-	instructions[0x6E] = (Instruction) {"ROR abs", inst_ROR, ABS, 6};
-	instructions[0x6F] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x70] = (Instruction) {"BVS rel", inst_BVS, REL, 2};
-	instructions[0x71] = (Instruction) {"ADC ind,Y", inst_ADC, INDY, 5};
-	instructions[0x72] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x73] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0x74] = (Instruction) {"???", inst_NOP, ZP, 4};
-	instructions[0x75] = (Instruction) {"ADC zpg,X", inst_ADC, ZPX, 4};
-	instructions[0x76] = (Instruction) {"ROR zpg,X", inst_ROR, ZPX, 6};
-	instructions[0x77] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x78] = (Instruction) {"SEI impl", inst_SEI, IMPL, 2};
-	instructions[0x79] = (Instruction) {"ADC abs,Y", inst_ADC, ABSY, 4};
-	instructions[0x7A] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x7B] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x7C] = (Instruction) {"???", inst_NOP, ABSX, 4};
-	instructions[0x7D] = (Instruction) {"ADC abs,X", inst_ADC, ABSX, 4};
-	instructions[0x7E] = (Instruction) {"ROR abs,X", inst_ROR, ABSX, 7};
-	instructions[0x7F] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0x80] = (Instruction) {"???", inst_NOP, IMM, 2};
-	instructions[0x81] = (Instruction) {"STA X,ind", inst_STA, XIND, 6};
-	instructions[0x82] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x83] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x84] = (Instruction) {"STY zpg", inst_STY, ZP, 3};
-	instructions[0x85] = (Instruction) {"STA zpg", inst_STA, ZP, 3};
-	instructions[0x86] = (Instruction) {"STX zpg", inst_STX, ZP, 3};
-	instructions[0x87] = (Instruction) {"???", inst_NOP, IMPL, 3};
-	instructions[0x88] = (Instruction) {"DEY impl", inst_DEY, IMPL, 2};
-	instructions[0x89] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x8A] = (Instruction) {"TXA impl", inst_TXA, IMPL, 2};
-	instructions[0x8B] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x8C] = (Instruction) {"STY abs", inst_STY, ABS, 4};
-	instructions[0x8D] = (Instruction) {"STA abs", inst_STA, ABS, 4};
-	instructions[0x8E] = (Instruction) {"STX abs", inst_STX, ABS, 4};
-	instructions[0x8F] = (Instruction) {"???", inst_NOP, IMPL, 4};
-	instructions[0x90] = (Instruction) {"BCC rel", inst_BCC, REL, 2};
-	instructions[0x91] = (Instruction) {"STA ind,Y", inst_STA, INDY, 6};
-	instructions[0x92] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0x93] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0x94] = (Instruction) {"STY zpg,X", inst_STY, ZPX, 4};
-	instructions[0x95] = (Instruction) {"STA zpg,X", inst_STA, ZPX, 4};
-	instructions[0x96] = (Instruction) {"STX zpg,Y", inst_STX, ZPY, 4};
-	instructions[0x97] = (Instruction) {"???", inst_NOP, IMPL, 4};
-	instructions[0x98] = (Instruction) {"TYA impl", inst_TYA, IMPL, 2};
-	instructions[0x99] = (Instruction) {"STA abs,Y", inst_STA, ABSY, 5};
-	instructions[0x9A] = (Instruction) {"TXS impl", inst_TXS, IMPL, 2};
-	instructions[0x9B] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x9C] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x9D] = (Instruction) {"STA abs,X", inst_STA, ABSX, 5};
-	instructions[0x9E] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0x9F] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0xA0] = (Instruction) {"LDY #", inst_LDY, IMM, 2};
-	instructions[0xA1] = (Instruction) {"LDA X,ind", inst_LDA, XIND, 6};
-	instructions[0xA2] = (Instruction) {"LDX #", inst_LDX, IMM, 2};
-	instructions[0xA3] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0xA4] = (Instruction) {"LDY zpg", inst_LDY, ZP, 3};
-	instructions[0xA5] = (Instruction) {"LDA zpg", inst_LDA, ZP, 3};
-	instructions[0xA6] = (Instruction) {"LDX zpg", inst_LDX, ZP, 3};
-	instructions[0xA7] = (Instruction) {"???", inst_NOP, IMPL, 3};
-	instructions[0xA8] = (Instruction) {"TAY impl", inst_TAY, IMPL, 2};
-	instructions[0xA9] = (Instruction) {"LDA #", inst_LDA, IMM, 2};
-	instructions[0xAA] = (Instruction) {"TAX impl", inst_TAX, IMPL, 2};
-	instructions[0xAB] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xAC] = (Instruction) {"LDY abs", inst_LDY, ABS, 4};
-	instructions[0xAD] = (Instruction) {"LDA abs", inst_LDA, ABS, 4};
-	instructions[0xAE] = (Instruction) {"LDX abs", inst_LDX, ABS, 4};
-	instructions[0xAF] = (Instruction) {"???", inst_NOP, IMPL, 4};
-	instructions[0xB0] = (Instruction) {"BCS rel", inst_BCS, REL, 2};
-	instructions[0xB1] = (Instruction) {"LDA ind,Y", inst_LDA, INDY, 5};
-	instructions[0xB2] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xB3] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0xB4] = (Instruction) {"LDY zpg,X", inst_LDY, ZPX, 4};
-	instructions[0xB5] = (Instruction) {"LDA zpg,X", inst_LDA, ZPX, 4};
-	instructions[0xB6] = (Instruction) {"LDX zpg,Y", inst_LDX, ZPY, 4};
-	instructions[0xB7] = (Instruction) {"???", inst_NOP, IMPL, 4};
-	instructions[0xB8] = (Instruction) {"CLV impl", inst_CLV, IMPL, 2};
-	instructions[0xB9] = (Instruction) {"LDA abs,Y", inst_LDA, ABSY, 4};
-	instructions[0xBA] = (Instruction) {"TSX impl", inst_TSX, IMPL, 2};
-	instructions[0xBB] = (Instruction) {"???", inst_NOP, IMPL, 4};
-	instructions[0xBC] = (Instruction) {"LDY abs,X", inst_LDY, ABSX, 4};
-	instructions[0xBD] = (Instruction) {"LDA abs,X", inst_LDA, ABSX, 4};
-	instructions[0xBE] = (Instruction) {"LDX abs,Y", inst_LDX, ABSY, 4};
-	instructions[0xBF] = (Instruction) {"???", inst_NOP, IMPL, 4};
-	instructions[0xC0] = (Instruction) {"CPY #", inst_CPY, IMM, 2};
-	instructions[0xC1] = (Instruction) {"CMP X,ind", inst_CMP, XIND, 6};
-	instructions[0xC2] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xC3] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0xC4] = (Instruction) {"CPY zpg", inst_CPY, ZP, 3};
-	instructions[0xC5] = (Instruction) {"CMP zpg", inst_CMP, ZP, 3};
-	instructions[0xC6] = (Instruction) {"DEC zpg", inst_DEC, ZP, 5};
-	instructions[0xC7] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0xC8] = (Instruction) {"INY impl", inst_INY, IMPL, 2};
-	instructions[0xC9] = (Instruction) {"CMP #", inst_CMP, IMM, 2};
-	instructions[0xCA] = (Instruction) {"DEX impl", inst_DEX, IMPL, 2};
-	instructions[0xCB] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xCC] = (Instruction) {"CPY abs", inst_CPY, ABS, 4};
-	instructions[0xCD] = (Instruction) {"CMP abs", inst_CMP, ABS, 4};
-	instructions[0xCE] = (Instruction) {"DEC abs", inst_DEC, ABS, 6};
-	instructions[0xCF] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0xD0] = (Instruction) {"BNE rel", inst_BNE, REL, 2};
-	instructions[0xD1] = (Instruction) {"CMP ind,Y", inst_CMP, INDY, 5};
-	instructions[0xD2] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xD3] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0xD4] = (Instruction) {"???", inst_NOP, ZP, 4};
-	instructions[0xD5] = (Instruction) {"CMP zpg,X", inst_CMP, ZPX, 4};
-	instructions[0xD6] = (Instruction) {"DEC zpg,X", inst_DEC, ZPX, 6};
-	instructions[0xD7] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0xD8] = (Instruction) {"CLD impl", inst_CLD, IMPL, 2};
-	instructions[0xD9] = (Instruction) {"CMP abs,Y", inst_CMP, ABSY, 4};
-	instructions[0xDA] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xDB] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0xDC] = (Instruction) {"???", inst_NOP, ABSX, 4};
-	instructions[0xDD] = (Instruction) {"CMP abs,X", inst_CMP, ABSX, 4};
-	instructions[0xDE] = (Instruction) {"DEC abs,X", inst_DEC, ABSX, 7};
-	instructions[0xDF] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0xE0] = (Instruction) {"CPX #", inst_CPX, IMM, 2};
-	instructions[0xE1] = (Instruction) {"SBC X,ind", inst_SBC, XIND, 6};
-	instructions[0xE2] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xE3] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0xE4] = (Instruction) {"CPX zpg", inst_CPX, ZP, 3};
-	instructions[0xE5] = (Instruction) {"SBC zpg", inst_SBC, ZP, 3};
-	instructions[0xE6] = (Instruction) {"INC zpg", inst_INC, ZP, 5};
-	instructions[0xE7] = (Instruction) {"???", inst_NOP, IMPL, 5};
-	instructions[0xE8] = (Instruction) {"INX impl", inst_INX, IMPL, 2};
-	instructions[0xE9] = (Instruction) {"SBC #", inst_SBC, IMM, 2};
-	instructions[0xEA] = (Instruction) {"NOP impl", inst_NOP, IMPL, 2};
-	instructions[0xEB] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xEC] = (Instruction) {"CPX abs", inst_CPX, ABS, 4};
-	instructions[0xED] = (Instruction) {"SBC abs", inst_SBC, ABS, 4};
-	instructions[0xEE] = (Instruction) {"INC abs", inst_INC, ABS, 6};
-	instructions[0xEF] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0xF0] = (Instruction) {"BEQ rel", inst_BEQ, REL, 2};
-	instructions[0xF1] = (Instruction) {"SBC ind,Y", inst_SBC, INDY, 5};
-	instructions[0xF2] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xF3] = (Instruction) {"???", inst_NOP, IMPL, 8};
-	instructions[0xF4] = (Instruction) {"???", inst_NOP, ZP, 4};
-	instructions[0xF5] = (Instruction) {"SBC zpg,X", inst_SBC, ZPX, 4};
-	instructions[0xF6] = (Instruction) {"INC zpg,X", inst_INC, ZPX, 6};
-	instructions[0xF7] = (Instruction) {"???", inst_NOP, IMPL, 6};
-	instructions[0xF8] = (Instruction) {"SED impl", inst_SED, IMPL, 2};
-	instructions[0xF9] = (Instruction) {"SBC abs,Y", inst_SBC, ABSY, 4};
-	instructions[0xFA] = (Instruction) {"???", inst_NOP, IMPL, 2};
-	instructions[0xFB] = (Instruction) {"???", inst_NOP, IMPL, 7};
-	instructions[0xFC] = (Instruction) {"???", inst_NOP, ABSX, 4};
-	instructions[0xFD] = (Instruction) {"SBC abs,X", inst_SBC, ABSX, 4};
-	instructions[0xFE] = (Instruction) {"INC abs,X", inst_INC, ABSX, 7};
-	instructions[0xFF] = (Instruction) {"???", inst_NOP, IMPL, 7};
-}
-
-void reset_cpu(int _a, int _x, int _y, int _sp, int _sr, int _pc)
-{
-	A = _a;
-	X = _x;
-	Y = _y;
-	SP = _sp;
+	cpu->A = _a;
+	cpu->X = _x;
+	cpu->Y = _y;
+	cpu->SP = _sp;
 	
-	SR.byte = _sr;
-	SR.bits.interrupt = 1;
-	SR.bits.unused = 1;
+	set_sr(cpu, _sr);
+	cpu->SR.bits.interrupt = 1;
+	cpu->SR.bits.unused = 1;
 	
 	if (_pc < 0)
-		memcpy(&PC, &memory[-_pc], sizeof(PC));
+		memcpy(&cpu->PC, &cpu->memory[-_pc], sizeof(cpu->PC));
 	else
-		PC = _pc;
+		cpu->PC = _pc;
 
-	total_cycles = 0;
+	cpu->total_cycles = 0;
 }
 
-int load_rom(char * filename, int load_addr)
+int load_rom(CPU * cpu, char * filename, int load_addr)
 {
 	int loaded_size, max_size;
 
-	memset(memory, 0, sizeof(memory)); // clear ram first
+	memset(cpu->memory, 0, MEMORY_SIZE); // clear ram first
+	if (cpu->cache) flush_block_cache(cpu);
+	if (cpu->jit) flush_jit(cpu);
 	
 	FILE * fp = fopen(filename, "r");
 	if (fp == NULL) {
@@ -964,45 +793,250 @@ int load_rom(char * filename, int load_addr)
 	}
 	
 	max_size = 0x10000 - load_addr;
-	loaded_size = (int)fread(&memory[load_addr], 1, (size_t)max_size, fp);
+	loaded_size = (int)fread(&cpu->memory[load_addr], 1, (size_t)max_size, fp);
 	fprintf(stderr, "Loaded $%04x bytes: $%04x - $%04x\n", loaded_size, load_addr, load_addr + loaded_size - 1);
 	
 	fclose(fp);
 	return 0;
 }
 
-int step_cpu(int verbose) // returns cycle count
+void print_state(CPU * cpu)
 {
-	inst = instructions[memory[PC]];
+	TraceRecord r;
 
-	if (verbose) {
-		// almost match for NES dump for easier comparison
-		printf("%04X  ", PC);
-		if (lengths[inst.mode] == 3)
-			printf("%02X %02X %02X", memory[PC], memory[PC+1], memory[PC+2]);
-		else if (lengths[inst.mode] == 2)
-			printf("%02X %02X   ", memory[PC], memory[PC+1]);
-		else
-			printf("%02X      ", memory[PC]);
-		printf("  %-10s                      A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d\n", inst.mnemonic, A, X, Y, SR.byte, SP, (int)((total_cycles * 3) % 341));
-	}
+	fill_record(cpu, &r);
+	print_record(stdout, &r);
+}
+
+#ifndef THREADED
+
+static int step_interp(CPU * cpu, int verbose) // returns cycle count
+{
+	uint8_t op;
 
-	jumping = 0;
-	extra_cycles = 0;
-	inst.function();
-	if (jumping == 0) PC += lengths[inst.mode];
+	if (cpu->cache) return step_cached(cpu, verbose);
+
+	op = cpu->memory[cpu->PC];
+	cpu->inst = instructions[op];
+
+	if (verbose) print_state(cpu);
+
+	cpu->jumping = 0;
+	cpu->extra_cycles = 0;
+	cpu->inst.function(cpu, cpu->inst.mode);
+	if (cpu->jumping == 0) cpu->PC += lengths[cpu->inst.mode];
 
 	// 7 cycle instructions (e.g. ROL $nnnn,X) don't have a penalty cycle for
 	// crossing a page boundary.
-	if (inst.cycles == 7) extra_cycles = 0;
+	if (cpu->inst.cycles == 7) cpu->extra_cycles = 0;
+	COUNT_STEP(cpu, op);
+
+	cpu->total_cycles += cpu->inst.cycles + cpu->extra_cycles;
+	return cpu->inst.cycles + cpu->extra_cycles;
+}
+
+#else
+
+/* Threaded Interpreter */
+
+// Each opcode gets its own copy of its handler with the addressing mode,
+// length and cycle count folded in as constants, and ends by jumping
+// straight to the next opcode's handler. This gives the branch predictor one
+// indirect jump per opcode to learn from instead of a single shared one.
+
+#pragma GCC diagnostic ignored "-Wpedantic" // computed goto is a GNU extension
+
+static void run_threaded(CPU * cpu, int verbose) // runs until total_cycles >= cpu->stop
+{
+	static void * const dispatch[0x100] = {
+#define OPCODE(op, mnemonic, name, mode, cycles) [op] = &&op_##op,
+#include "opcodes.h"
+#undef OPCODE
+	};
+
+	if (verbose) print_state(cpu);
+	goto *dispatch[cpu->memory[cpu->PC]];
+
+#define OPCODE(op, mnemonic, name, mode, cycles) \
+op_##op: \
+	cpu->jumping = 0; \
+	cpu->extra_cycles = 0; \
+	inst_##name(cpu, mode); \
+	if (cpu->jumping == 0) cpu->PC += lengths[mode]; \
+	if (cycles == 7) cpu->extra_cycles = 0; \
+	COUNT_STEP(cpu, op); \
+	cpu->total_cycles += cycles + cpu->extra_cycles; \
+	if (cpu->total_cycles >= cpu->stop) return; \
+	if (verbose) print_state(cpu); \
+	goto *dispatch[cpu->memory[cpu->PC]];
+#include "opcodes.h"
+#undef OPCODE
+}
+
+static int step_interp(CPU * cpu, int verbose) // returns cycle count
+{
+	uint64_t start = cpu->total_cycles, stop = cpu->stop;
+
+	if (cpu->cache) return step_cached(cpu, verbose);
+
+	cpu->stop = start + 1;
+	run_threaded(cpu, verbose);
+	if (cpu->stop == start + 1) cpu->stop = stop; // otherwise an interrupt moved it
+	return cpu->total_cycles - start;
+}
+
+#endif
 
-	total_cycles += inst.cycles + extra_cycles;
-	return inst.cycles + extra_cycles;
+int step_cpu(CPU * cpu, int verbose) // returns cycle count
+{
+	int cycles;
+
+	// native routines and compiled blocks skip over instructions, so tracing stays interpreted
+	if (cpu->hle && cpu->hle->slots[cpu->PC] && !verbose && (cycles = run_trap(cpu)) > 0) return cycles;
+	if (cpu->jit && !verbose && (cycles = run_jit(cpu)) > 0) return cycles;
+
+	return step_interp(cpu, verbose);
+}
+
+/* Run Loops */
+
+// The options are constant for a whole run, so rather than testing each of
+// them after every instruction, run_loop is stamped out once per combination
+// and run_cycles picks the right copy. With no options set the loop only
+// compares total_cycles against cpu->stop, which is also how events and
+// interrupts get it to return early.
+
+static inline __attribute__((always_inline)) int run_loop(CPU * cpu, int flags)
+{
+	uint16_t pc;
+	int cycles;
+
+#ifdef THREADED
+	if (!(flags & ~RUN_TRACE) && !cpu->cache && !cpu->jit && !cpu->hle) {
+		run_threaded(cpu, flags & RUN_TRACE);
+		return 0;
+	}
+#endif
+	while (cpu->total_cycles < cpu->stop) {
+		pc = cpu->PC;
+		if (flags & RUN_DUMP) dump_memory(cpu);
+		if (flags & RUN_RING) record_ring(cpu);
+		if (flags & (RUN_RECORD | RUN_DUMP | RUN_PROFILE)) {
+			if (flags & RUN_RECORD) record_trace(cpu);
+			cycles = step_interp(cpu, flags & RUN_TRACE); // every instruction has to be recorded, so no compiled blocks
+			if (flags & RUN_PROFILE) profile_step(cpu, pc, cycles);
+		} else {
+			step_cpu(cpu, flags & RUN_TRACE);
+		}
+		if ((flags & RUN_BREAK) && cpu->PC == cpu->break_pc) return RUN_BREAK;
+		if (flags & RUN_STUCK) {
+			if (cpu->PC != pc) cpu->stuck_steps = 0;
+			else if (++cpu->stuck_steps >= cpu->stuck_limit) return RUN_STUCK;
+		}
+	}
+	return 0;
+}
+
+#define RUN_VARIANT(hi, lo) \
+static int run_##hi##_##lo(CPU * cpu) { return run_loop(cpu, hi * 8 + lo); }
+#define RUN_VARIANTS_8(hi) \
+	RUN_VARIANT(hi, 0) RUN_VARIANT(hi, 1) RUN_VARIANT(hi, 2) RUN_VARIANT(hi, 3) \
+	RUN_VARIANT(hi, 4) RUN_VARIANT(hi, 5) RUN_VARIANT(hi, 6) RUN_VARIANT(hi, 7)
+#define RUN_TABLE_8(hi) \
+	run_##hi##_0, run_##hi##_1, run_##hi##_2, run_##hi##_3, \
+	run_##hi##_4, run_##hi##_5, run_##hi##_6, run_##hi##_7,
+
+RUN_VARIANTS_8(0) RUN_VARIANTS_8(1) RUN_VARIANTS_8(2) RUN_VARIANTS_8(3)
+RUN_VARIANTS_8(4) RUN_VARIANTS_8(5) RUN_VARIANTS_8(6) RUN_VARIANTS_8(7)
+RUN_VARIANTS_8(8) RUN_VARIANTS_8(9) RUN_VARIANTS_8(10) RUN_VARIANTS_8(11)
+RUN_VARIANTS_8(12) RUN_VARIANTS_8(13) RUN_VARIANTS_8(14) RUN_VARIANTS_8(15)
+
+static int (* const run_variants[RUN_VARIANTS])(CPU * cpu) = {
+	RUN_TABLE_8(0) RUN_TABLE_8(1) RUN_TABLE_8(2) RUN_TABLE_8(3)
+	RUN_TABLE_8(4) RUN_TABLE_8(5) RUN_TABLE_8(6) RUN_TABLE_8(7)
+	RUN_TABLE_8(8) RUN_TABLE_8(9) RUN_TABLE_8(10) RUN_TABLE_8(11)
+	RUN_TABLE_8(12) RUN_TABLE_8(13) RUN_TABLE_8(14) RUN_TABLE_8(15)
+};
+
+#undef RUN_VARIANT
+#undef RUN_VARIANTS_8
+#undef RUN_TABLE_8
+
+/* Interrupts */
+
+// Pending interrupts are a single word that the run loops never look at.
+// Raising one pulls cpu->stop in to the current cycle instead, so the loop
+// returns at the end of the instruction in progress and run_cycles takes the
+// interrupt from there. CLI, PLP and RTI do the same when an IRQ is waiting,
+// since they may have unmasked it.
+
+void raise_irq(CPU * cpu, uint32_t line) // held until lower_irq, like the real level-triggered line
+{
+	cpu->interrupts |= line;
+	cpu->stop = cpu->total_cycles;
+}
+
+void lower_irq(CPU * cpu, uint32_t line)
+{
+	cpu->interrupts &= ~line;
+}
+
+void raise_nmi(CPU * cpu) // taken once per call, like an edge on the real line
+{
+	cpu->interrupts |= INT_NMI;
+	cpu->stop = cpu->total_cycles;
+}
+
+static void interrupt(CPU * cpu, uint16_t vector)
+{
+	uint16_t newPC;
+	memcpy(&newPC, &cpu->memory[vector], sizeof(newPC));
+	stack_push(cpu, cpu->PC >> 8);
+	stack_push(cpu, cpu->PC & 0xFF);
+	stack_push(cpu, (get_sr(cpu) & ~0x10) | 0x20); // B clear, unlike BRK
+	cpu->SR.bits.interrupt = 1;
+	cpu->PC = newPC;
+	cpu->total_cycles += 7;
+	if (cpu->cache) cpu->cache->next = NULL; // the block being run is left part way through
+}
+
+static void take_interrupts(CPU * cpu)
+{
+	if (cpu->interrupts & INT_NMI) {
+		cpu->interrupts &= ~INT_NMI;
+		interrupt(cpu, NMI_VEC);
+	} else if (!cpu->SR.bits.interrupt) {
+		interrupt(cpu, IRQ_VEC);
+	}
+}
+
+void halt_cpu(CPU * cpu) // for devices on the CPU's thread, e.g. when the user quits
+{
+	cpu->halted = true;
+	cpu->stop = cpu->total_cycles;
+}
+
+int run_cycles(CPU * cpu, uint64_t budget) // returns why it stopped early (RUN_BREAK or RUN_STUCK), or 0 once budget cycles have run or the CPU is halted
+{
+	uint64_t end = cpu->total_cycles + budget;
+	int (* run)(CPU * cpu) = run_variants[cpu->run_flags];
+	int why;
+
+	if (end < budget) end = UINT64_MAX; // unlimited
+	if (cpu->cache && !cpu->jit && !(cpu->run_flags & ~RUN_BREAK)) run = run_cached;
+	for (;;) {
+		if (cpu->interrupts) take_interrupts(cpu);
+		cpu->stop = cpu->deadline < end ? cpu->deadline : end;
+		if ((why = run(cpu))) return why;
+		if (cpu->total_cycles >= end) return 0;
+		run_events(cpu);
+		if (cpu->halted) return 0;
+	}
 }
 
-void save_memory(char * filename) { // dump memory for analysis (slows down emulation significantly)
+void save_memory(CPU * cpu, char * filename) { // dump memory for analysis (slows down emulation significantly)
 	if (filename == NULL) filename = "memdump";
 	FILE * fp = fopen(filename, "w");
-	fwrite(&memory, sizeof(memory), 1, fp);
+	fwrite(cpu->memory, MEMORY_SIZE, 1, fp);
 	fclose(fp);
 }
@@ -1,27 +1,33 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define CPU_FREQ 4e6 // 4Mhz
-#define STEP_DURATION 10e6 // 10ms
+#define CPU_FREQ 4e6 // 4Mhz, unless -F says otherwise
+#define STEP_DURATION 10e6 // 10ms, unless -q says otherwise
+#define MAX_LAG 100e6 // 100ms; pacing gives up on time lost beyond this
 #define ONE_SECOND 1e9
-#define NUM_MODES 14
+#define NUM_MODES 15
+#define MAX_EVENTS 16 // pending events per machine
+#define MAX_DEVICE_STATES 8 // device state blocks saved in snapshots
+#define MEMORY_SIZE 0x10000
+
+// run_cycles options; each combination gets its own copy of the run loop
+#define RUN_TRACE 1 // print each instruction before it runs
+#define RUN_DUMP 2 // bring the memory dumps up to date before each instruction
+#define RUN_BREAK 4 // stop when PC reaches break_pc
+#define RUN_RECORD 8 // write a binary trace record for each instruction
+#define RUN_RING 16 // keep the last few steps in cpu->ring
+#define RUN_STUCK 32 // stop when the PC stays put for stuck_limit steps
+#define RUN_PROFILE 64 // add up the cycles spent at each address
+#define RUN_VARIANTS 128
+
+// bits of cpu->interrupts; IRQ sources each take one of the others
+#define INT_NMI 1
+#define INT_UART 2
 
 #define NMI_VEC 0xFFFA
 #define RST_VEC 0xFFFC
 #define IRQ_VEC 0xFFFE
 
-extern uint8_t memory[1<<16];
-extern uint8_t A;
-extern uint8_t X;
-extern uint8_t Y;
-extern uint16_t PC;
-extern uint8_t SP; // points to first empty stack location
-extern uint8_t extra_cycles;
-extern uint64_t total_cycles;
-
-extern void * read_addr;
-extern void * write_addr;
-
 struct StatusBits{
 	bool carry:1; // bit 0
 	bool zero:1;
@@ -38,8 +44,6 @@ union StatusReg { // this means we can access the status register as a byte, or
 	uint8_t byte;
 };
 
-extern union StatusReg SR;
-
 typedef enum {
 	ACC,
 	ABS,
@@ -55,23 +59,156 @@ typedef enum {
 	ZPX,
 	ZPY,
 	JMP_IND_BUG,
+	RESOLVED, // operand address worked out in advance by the block cache
 } Mode;
 
+typedef struct CPU CPU;
+
+typedef struct {
+	uint64_t when; // total_cycles at which the event fires
+	void (*callback)(CPU * cpu, void * data);
+	void * data;
+} Event;
+
+typedef struct { // part of a device that is saved and restored with the machine
+	const char * name; // identifies the block in a snapshot, at most 15 characters
+	void * data;
+	uint32_t size;
+} DeviceState;
+
+typedef struct { // one 256 byte page of the address space
+	uint8_t * read; // page contents for direct reads, or NULL to call read_handler
+	uint8_t * write; // page contents for direct writes, or NULL to call write_handler
+	uint8_t (*read_handler)(void * device, uint16_t addr);
+	void (*write_handler)(void * device, uint16_t addr, uint8_t val);
+	void * device;
+	bool watched; // RAM holding cached or compiled code; writes are checked
+} Page;
+
 typedef struct {
 	char * mnemonic;
-	void (*function)();
+	void (*function)(CPU * cpu, Mode mode);
 	Mode mode;
 	uint8_t cycles;
 } Instruction;
 
-extern Instruction instructions[0x100];
+typedef int (*Fusion)(CPU * cpu); // runs a pair of instructions from fusions.h, returns how many of them it ran
+
+struct CPU { // everything needed to run one machine; instances share nothing
+	uint8_t * memory; // ram, or a mapping passed to use_memory (a snapshot or a shared image)
+	uint8_t A;
+	uint8_t X;
+	uint8_t Y;
+	uint16_t PC;
+	uint8_t SP; // points to first empty stack location
+	union StatusReg SR; // only I, D, B and the unused bit are kept up to date here
+	uint16_t nz; // last result: Z is set when the low byte is 0, N when bit 7 or 8 is set
+	uint8_t carry; // 0 or 1
+	uint8_t v; // V is bit 7
+	uint8_t extra_cycles;
+	uint64_t total_cycles;
+
+	Instruction inst; // the current instruction (used for convenience)
+	int jumping; // used to check that we don't need to increment the PC after a jump
+	Page pages[0x100]; // memory map; instructions are always fetched from memory[]
+
+	int run_flags; // RUN_* options for run_cycles
+	uint16_t break_pc;
+	uint32_t stuck_limit;
+	uint32_t stuck_steps; // steps in a row that left the PC where it was
+	uint64_t deadline; // when the next event is due; instructions run freely until then
+	uint64_t stop; // where the run loop returns: the deadline, the end of the run, or now for an interrupt
+	uint32_t interrupts; // INT_ bits waiting to be taken; IRQs stay set while their line is held
+	bool halted; // set by halt_cpu; run_cycles returns instead of running on
+	Event events[MAX_EVENTS]; // min-heap ordered by when
+	int num_events;
+
+	struct BlockCache * cache; // predecoded blocks, NULL when disabled
+	uint16_t resolved; // operand address for RESOLVED mode
+	struct Jit * jit; // compiled blocks, NULL when disabled
+	struct Trace * trace; // binary trace output, NULL when disabled
+	struct Ring * ring; // recent history, NULL when disabled
+	struct Dump * dump; // memory dumps, NULL when disabled
+	struct Profile * profile; // cycles per address, NULL when disabled
+	struct Idle * idle; // polling loop detection, NULL when disabled
+	struct Hle * hle; // native versions of known ROM routines, NULL when disabled
+	struct Stats * stats; // instruction counters, NULL when disabled or not built with STATS
+
+	DeviceState device_states[MAX_DEVICE_STATES];
+	int num_device_states;
+	uint8_t ram[MEMORY_SIZE];
+};
+
+/* Lazy Flags */
+
+#define ZERO(cpu) (((cpu)->nz & 0xFF) == 0)
+#define SIGN(cpu) (((cpu)->nz & 0x180) != 0)
+#define OVERFLOW(cpu) (((cpu)->v & 0x80) != 0)
+
+static inline uint8_t get_sr(CPU * cpu)
+{
+	return (cpu->SR.byte & 0x3C) | cpu->carry | ZERO(cpu) << 1 | OVERFLOW(cpu) << 6 | SIGN(cpu) << 7;
+}
+
+static inline void set_sr(CPU * cpu, uint8_t sr)
+{
+	cpu->SR.byte = sr;
+	cpu->carry = sr & 1;
+	cpu->v = sr << 1;
+	cpu->nz = (sr & 0x80) << 1 | !(sr & 0x02); // any byte that gives the same N and Z
+}
+
+extern Instruction instructions[0x100]; // read-only once init_tables() has run
+extern const int lengths[NUM_MODES];
 
 void init_tables();
 
-void reset_cpu(int _a, int _x, int _y, int _sp, int _sr, int _pc);
+Fusion find_fusion(uint8_t first, uint8_t second);
+
+void init_bus(CPU * cpu);
+
+void map_memory(CPU * cpu, uint8_t first, uint8_t last, bool writable);
+
+void map_device(CPU * cpu, uint8_t page, uint8_t (*read_handler)(void * device, uint16_t addr),
+	void (*write_handler)(void * device, uint16_t addr, uint8_t val), void * device);
+
+void watch_code(CPU * cpu, uint16_t start, uint32_t end);
+
+static inline bool is_ram(CPU * cpu, uint8_t page) // memory[] may be read and written directly
+{
+	return cpu->pages[page].read == &cpu->memory[page << 8] && (cpu->pages[page].write || cpu->pages[page].watched);
+}
+
+int schedule(CPU * cpu, uint64_t when, void (*callback)(CPU * cpu, void * data), void * data);
+
+void run_events(CPU * cpu);
+
+void reset_cpu(CPU * cpu, int _a, int _x, int _y, int _sp, int _sr, int _pc);
+
+int load_rom(CPU * cpu, char * filename, int load_addr);
+
+int step_cpu(CPU * cpu, int verbose);
+
+int run_cycles(CPU * cpu, uint64_t budget);
+
+void halt_cpu(CPU * cpu);
+
+void raise_irq(CPU * cpu, uint32_t line);
+
+void lower_irq(CPU * cpu, uint32_t line);
+
+void raise_nmi(CPU * cpu);
+
+void print_state(CPU * cpu);
+
+void save_memory(CPU * cpu, char * filename);
+
+int add_device_state(CPU * cpu, const char * name, void * data, uint32_t size);
+
+int save_state(CPU * cpu, char * filename);
 
-int load_rom(char * filename, int load_addr);
+void use_memory(CPU * cpu, uint8_t * memory);
 
-int step_cpu(int verbose);
+int load_state(CPU * cpu, char * filename);
 
-void save_memory(char * filename);
+void free_state(CPU * cpu);
@@ -1,59 +1,207 @@
 #include <stdio.h>
 #include <unistd.h>
-#include <sys/poll.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "6502.h"
 #include "6850.h"
 
-int n;
+/* Output Buffering */
 
-void init_uart() {
-	memory[DATA_ADDR] = 0;
-	
-	uart_SR.byte = 0;
-	uart_SR.bits.TDRE = 1; // we are always ready to output data
-	
-	uart_SR.bits.RDRF = 0;
-	incoming_char = 0;
-	
-}
+// Output collects in the stdio buffer of uart->output and is written out on
+// a newline (terminals only), when the buffer fills, when the guest starts
+// waiting for input, or once it has waited OUTPUT_DELAY_NS.
 
-int stdin_ready() {
-	struct pollfd fds;
-	fds.fd = 0; // stdin
-	fds.events = POLLIN;
-	return poll(&fds, 1, 0) == 1; // timeout = 0
+static void flush_output(Uart * uart) {
+	if (!uart->pending) return;
+	fflush(uart->output);
+	uart->pending = false;
 }
 
-void step_uart() {
-	if (write_addr == &memory[DATA_ADDR]) {
-		putchar(memory[DATA_ADDR]);
-		if (memory[DATA_ADDR] == '\b') printf(" \b");
-		fflush(stdout);
-		write_addr = NULL;
-	} else if (read_addr == &memory[DATA_ADDR]) {
-		uart_SR.bits.RDRF = 0;
-		read_addr = NULL;
+static void put_output(Uart * uart, uint8_t val) {
+	putc(val, uart->output);
+	if (val == '\b') fputs(" \b", uart->output);
+	if (!uart->pending) {
+		uart->pending = true;
+		clock_gettime(CLOCK_MONOTONIC, &uart->pending_since);
 	}
-	
-	/* update input register if empty */
-	if ((n++ % 10000) == 0) { // polling stdin every cycle is performance intensive. This is a bit of a dirty hack.
-		if (!uart_SR.bits.RDRF && stdin_ready()) { // the real hardware has no buffer. Remote the RDRF check for more accurate emulation.
-			if (read(0, &incoming_char, 1) != 1) {
-				printf("Warning: read() returned 0\n");
-			}
-			if (incoming_char == 0x18) { // CTRL+X
-				printf("\r\n");
-				exit(0);
+	if (val == '\n' && uart->line_flush) flush_output(uart);
+}
+
+/* Interrupts */
+
+static void update_irq(Uart * uart) { // drives the IRQ line from the status and control registers
+	bool irq = ((uart->CR & CR_RX_IRQ) && uart->SR.bits.RDRF)
+		|| ((uart->CR & CR_TX) == CR_TX_IRQ && uart->SR.bits.TDRE);
+
+	if (irq == uart->SR.bits.IRQ) return;
+	uart->SR.bits.IRQ = irq;
+	if (irq) raise_irq(uart->cpu, INT_UART);
+	else lower_irq(uart->cpu, INT_UART);
+}
+
+/* Input Thread */
+
+// The input thread does blocking reads and is the only writer of ring.head;
+// the CPU thread is the only writer of ring.tail. Neither ever waits on the
+// other, so the emulated status register costs one load when idle.
+
+static void * input_thread(void * arg) {
+	Uart * uart = arg;
+	InputRing * ring = &uart->input;
+	struct timespec wait = {0, 1000000}; // 1ms
+	uint8_t buf[256];
+	unsigned head = ring->head;
+	ssize_t n, i;
+
+	while ((n = read(uart->input_fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] == 0x18) { // CTRL+X
+				__atomic_store_n(&uart->quit, true, __ATOMIC_RELEASE);
+				return NULL; // check_uart stops the run
 			}
-			if (incoming_char == 0x7F) { // Backspace
-				incoming_char = '\b';
+			if (buf[i] == 0x7F) { // Backspace
+				buf[i] = '\b';
 			}
-			uart_SR.bits.RDRF = 1;
+			// the guest is slower than a paste; wait for it rather than drop input
+			while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == INPUT_RING_SIZE)
+				nanosleep(&wait, NULL);
+			ring->buf[head % INPUT_RING_SIZE] = buf[i];
+			__atomic_store_n(&ring->head, ++head, __ATOMIC_RELEASE);
 		}
 	}
+	return NULL; // end of input; the guest keeps running
+}
+
+static void fill_input(Uart * uart) {
+	InputRing * ring = &uart->input;
+	unsigned tail = ring->tail;
+
+	// the real hardware has no buffer, so only one character is visible at a time
+	if (uart->SR.bits.RDRF) return;
+	if (uart->script) {
+		if (uart->script_pos == uart->script_size) return;
+		uart->incoming_char = uart->script[uart->script_pos++];
+	} else if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+		flush_output(uart); // the guest is probably waiting for a reply to what it printed
+		return;
+	} else {
+		uart->incoming_char = ring->buf[tail % INPUT_RING_SIZE];
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	uart->SR.bits.RDRF = 1;
+	update_irq(uart);
+}
+
+/* Events */
+
+// A guest that polls the status register picks up input as it reads it; one
+// that waits for receive interrupts has it picked up here instead.
+
+static void check_uart(CPU * cpu, void * device) {
+	Uart * uart = device;
+	struct timespec now;
+
+	if (__atomic_load_n(&uart->quit, __ATOMIC_ACQUIRE)) {
+		if (uart->line_flush) fputs("\r\n", uart->output); // leave the terminal on a fresh line
+		flush_output(uart);
+		halt_cpu(cpu);
+		return;
+	}
+	if (uart->pending) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - uart->pending_since.tv_sec) * 1000000000L
+				+ (now.tv_nsec - uart->pending_since.tv_nsec) >= OUTPUT_DELAY_NS)
+			flush_output(uart);
+	}
+	if (uart->CR & CR_RX_IRQ) fill_input(uart);
+	schedule(cpu, cpu->total_cycles + OUTPUT_CHECK_CYCLES, check_uart, uart);
+}
+
+/* Registers */
+
+static uint8_t uart_read(void * device, uint16_t addr) {
+	Uart * uart = device;
+
+	switch (addr) {
+	case CTRL_ADDR:
+		fill_input(uart);
+		return uart->SR.byte;
+	case DATA_ADDR:
+		uart->SR.bits.RDRF = 0;
+		update_irq(uart);
+		return uart->incoming_char;
+	default: // the rest of the page is still RAM
+		return uart->cpu->memory[addr];
+	}
+}
+
+static void uart_write(void * device, uint16_t addr, uint8_t val) {
+	Uart * uart = device;
+
+	switch (addr) {
+	case CTRL_ADDR: // only the interrupt enables do anything; a master reset clears them
+		uart->CR = (val & CR_DIVIDE) == CR_MASTER_RESET ? 0 : val;
+		update_irq(uart);
+		break;
+	case DATA_ADDR:
+		put_output(uart, val);
+		break;
+	default:
+		uart->cpu->memory[addr] = val;
+		break;
+	}
+}
+
+static void attach_uart(Uart * uart, CPU * cpu, int input_fd, FILE * output) {
+	uart->cpu = cpu;
+	
+	uart->SR.byte = 0;
+	uart->SR.bits.TDRE = 1; // we are always ready to output data
+	uart->CR = 0;
+	
+	uart->SR.bits.RDRF = 0;
+	uart->incoming_char = 0;
+	uart->input.head = 0;
+	uart->input.tail = 0;
+	uart->quit = false;
+	uart->input_fd = input_fd;
+	uart->output = output;
+	uart->line_flush = isatty(fileno(output)); // batch output only waits for a full buffer
+	uart->pending = false;
+	setvbuf(output, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
 	
-	memory[DATA_ADDR] = incoming_char;
-	memory[CTRL_ADDR] = uart_SR.byte;
+	map_device(cpu, CTRL_ADDR >> 8, uart_read, uart_write, uart); // DATA_ADDR is on the same page
+	add_device_state(cpu, "6850 status", &uart->SR, sizeof(uart->SR));
+	add_device_state(cpu, "6850 data", &uart->incoming_char, sizeof(uart->incoming_char));
+	add_device_state(cpu, "6850 control", &uart->CR, sizeof(uart->CR));
+	schedule(cpu, cpu->total_cycles + OUTPUT_CHECK_CYCLES, check_uart, uart);
+}
+
+int init_uart(Uart * uart, CPU * cpu, int input_fd, FILE * output) {
+	pthread_t thread;
+	sigset_t block, old;
+	int err;
+
+	attach_uart(uart, cpu, input_fd, output);
+	uart->script = NULL;
+	// the thread starts with these blocked, so SIGINT and SIGUSR1 land on the CPU's thread
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	err = pthread_create(&thread, NULL, input_thread, uart);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+void init_uart_script(Uart * uart, CPU * cpu, const uint8_t * script, size_t size, FILE * output) { // no input thread
+	attach_uart(uart, cpu, -1, output);
+	uart->script = script;
+	uart->script_size = size;
+	uart->script_pos = 0;
 }
@@ -1,7 +1,20 @@
+#include <stdio.h>
+#include <time.h>
 #include <stdbool.h>
 
 #define CTRL_ADDR 0xA000
 #define DATA_ADDR 0xA001
+#define INPUT_RING_SIZE 4096 // bytes of typed or pasted input held for the guest, must be a power of two
+#define OUTPUT_BUFFER_SIZE 4096 // bytes of output held before a write
+#define OUTPUT_DELAY_NS 10000000 // longest time output is held back (10ms)
+#define OUTPUT_CHECK_CYCLES 10000 // how often that time, and input for receive interrupts, is checked
+
+// control register
+#define CR_DIVIDE 0x03 // counter divide select
+#define CR_MASTER_RESET 0x03 // ...with both bits set
+#define CR_TX 0x60 // transmitter control
+#define CR_TX_IRQ 0x20 // ...with the transmit interrupt enabled
+#define CR_RX_IRQ 0x80 // receive interrupt enable
 
 struct UartStatusBits{
 	bool RDRF:1; // bit 0
@@ -19,10 +32,29 @@ union UartStatusReg {
 	uint8_t byte;
 };
 
-union UartStatusReg uart_SR;
+typedef struct { // single producer, single consumer
+	uint8_t buf[INPUT_RING_SIZE];
+	unsigned head; // next slot the input thread fills
+	unsigned tail; // next slot the CPU takes
+} InputRing;
 
-uint8_t incoming_char;
+typedef struct {
+	CPU * cpu; // the machine this UART is mapped into
+	union UartStatusReg SR;
+	uint8_t CR;
+	uint8_t incoming_char;
+	InputRing input;
+	bool quit; // set by the input thread on CTRL+X, acted on by the CPU thread
+	int input_fd; // -1 when input comes from script
+	const uint8_t * script; // input fed to the guest as fast as it reads it, or NULL
+	size_t script_size;
+	size_t script_pos;
+	FILE * output;
+	bool line_flush; // flush on newline, for terminals
+	bool pending; // output is buffered but not yet written
+	struct timespec pending_since;
+} Uart;
 
-void init_uart();
+int init_uart(Uart * uart, CPU * cpu, int input_fd, FILE * output);
 
-void step_uart();
+void init_uart_script(Uart * uart, CPU * cpu, const uint8_t * script, size_t size, FILE * output);
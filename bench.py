@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+
+# Times the emulator on fixed workloads, each run in -f mode for a fixed
+# number of cycles, and reports emulated MHz, instructions per second and
+# host nanoseconds per instruction over several runs. Results can be saved as
+# JSON and compared with an earlier run, e.g. one from another commit. Idle
+# fast-forwarding is off (-I), since the instruction count comes from a -P
+# run, which never skips polls. A -P run also goes through the interpreter,
+# not through -H's native routines or -J's compiled code, so its count isn't
+# what those runs execute; with -H or -J only MHz is reported.
+#
+# usage: bench.py [-n RUNS] [-o RESULTS] [-c BASELINE] [-- EMULATOR FLAGS]
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = sys.path[0]
+EMU = os.path.join(ROOT, '6502-emu')
+
+UNCOUNTED = 'HJ' # flags whose runs don't execute the instructions a -P run counts
+
+# name, emulator arguments, cycle budget, UART input (or None)
+WORKLOADS = [
+    ('functional', ['-s', '0xfd', '-l', '0x000a', '-r', '0x1000', 'test/6502_functional_test+decimal.bin'], 90000000, None),
+    ('nestest', ['-s', '0xfd', '-r', '0xc000', 'test/nestest-real-6502.rom'], 300000, None),
+    ('mandelbrot', ['examples/ehbasic.rom'], 600000000, 'examples/mandelbrot.bas'),
+]
+
+
+def basic_input(path, tmp):
+    # cold start, default memory size, then the program and RUN, with the CRs ehBASIC expects
+    with open(os.path.join(ROOT, path)) as f:
+        program = f.read().replace('\n', '\r')
+    name = os.path.join(tmp, 'input')
+    with open(name, 'w') as f:
+        f.write('C\r\r' + program + 'RUN\r')
+    return name
+
+
+def command(args, cycles, input_path, tmp, flags):
+    cmd = [EMU, '-f', '-I', '-c', str(cycles), '-o', os.path.join(tmp, 'output')] + flags
+    if input_path:
+        cmd += ['-u', basic_input(input_path, tmp)]
+    return cmd + args
+
+
+def count_instructions(cmd, tmp):
+    # the profiler's report starts with the number of instructions run
+    report = os.path.join(tmp, 'profile')
+    subprocess.run(cmd[:1] + ['-P', report] + cmd[1:], cwd=ROOT, stdin=subprocess.DEVNULL,
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, check=True)
+    with open(report) as f:
+        return int(re.match(r'\d+ cycles in (\d+) instructions', f.readline()).group(1))
+
+
+def counted(flags):
+    # whether a -P run counts the instructions these flags run, also when given together as e.g. -BJ
+    return not any(f.startswith('-') and not f.startswith('--') and any(c in f[1:] for c in UNCOUNTED) for f in flags)
+
+
+def run(name, args, cycles, input_path, runs, flags):
+    with tempfile.TemporaryDirectory() as tmp:
+        cmd = command(args, cycles, input_path, tmp, flags)
+        instructions = count_instructions(cmd, tmp) if counted(flags) else None
+        times = []
+        for i in range(runs):
+            start = time.perf_counter()
+            subprocess.run(cmd, cwd=ROOT, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL, check=True)
+            times.append(time.perf_counter() - start)
+        if input_path:
+            with open(os.path.join(tmp, 'output'), 'rb') as f:
+                if f.read().count(b'Ready') < 2:
+                    print('%s: the program did not finish in %d cycles' % (name, cycles), file=sys.stderr)
+
+    best = min(times)
+    return {
+        'cycles': cycles,
+        'instructions': instructions,
+        'seconds': times,
+        'mean': statistics.mean(times),
+        'stdev': statistics.stdev(times) if len(times) > 1 else 0.0,
+        'mhz': cycles / best / 1e6,
+        'ips': instructions / best if instructions else None,
+        'ns_per_instruction': best * 1e9 / instructions if instructions else None,
+    }
+
+
+def git_commit():
+    try:
+        return subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], cwd=ROOT, capture_output=True,
+                              text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the emulator on fixed workloads.')
+    parser.add_argument('-n', '--runs', type=int, default=5, help='timed runs of each workload (default 5)')
+    parser.add_argument('-o', '--output', help='write the results to this JSON file')
+    parser.add_argument('-c', '--compare', help='compare against results saved with -o')
+    parser.add_argument('flags', nargs='*', help='extra emulator flags, e.g. -- -J')
+    opts = parser.parse_args()
+
+    baseline = None
+    if opts.compare:
+        with open(opts.compare) as f:
+            baseline = json.load(f)['workloads']
+
+    results = {'commit': git_commit(), 'flags': opts.flags, 'runs': opts.runs, 'workloads': {}}
+    print('%-12s %10s %14s %10s %10s %8s' % ('workload', 'MHz', 'instr/s', 'ns/instr', 'mean s', 'stdev'))
+    for name, args, cycles, input_path in WORKLOADS:
+        if not os.path.exists(os.path.join(ROOT, args[-1])):
+            print('%-12s skipped, %s is missing' % (name, args[-1]))
+            continue
+        r = run(name, args, cycles, input_path, opts.runs, opts.flags)
+        results['workloads'][name] = r
+        if r['instructions'] is None:
+            ips = ns = '-'
+        else:
+            ips, ns = '%.0f' % r['ips'], '%.2f' % r['ns_per_instruction']
+        line = '%-12s %10.2f %14s %10s %10.3f %7.1f%%' % (name, r['mhz'], ips, ns, r['mean'],
+                                                         100 * r['stdev'] / r['mean'])
+        if baseline and name in baseline:
+            line += '  %+.1f%% vs %s' % (100 * (r['mhz'] / baseline[name]['mhz'] - 1), opts.compare)
+        print(line)
+
+    if opts.output:
+        with open(opts.output, 'w') as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "cache.h"
+#include "stats.h"
+#include "hle.h"
+
+/* Decoding */
+
+static inline Block * slot(struct BlockCache * cache, uint16_t start)
+{
+	return &cache->blocks[(start ^ (start >> 12)) & (CACHE_SIZE - 1)];
+}
+
+static int ends_block(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x00: // BRK
+	case 0x20: // JSR
+	case 0x40: // RTI
+	case 0x4C: // JMP abs
+	case 0x60: // RTS
+	case 0x6C: // JMP ind
+		return 1;
+	default:
+		return instructions[opcode].mode == REL;
+	}
+}
+
+static void decode(CPU * cpu, uint16_t pc, DecodedInst * d)
+{
+	Instruction * inst = &instructions[cpu->memory[pc]];
+	uint16_t operand = cpu->memory[(uint16_t)(pc+1)] | (cpu->memory[(uint16_t)(pc+2)] << 8);
+
+	d->function = inst->function;
+	d->mode = RESOLVED;
+	d->opcode = cpu->memory[pc];
+	d->length = lengths[inst->mode];
+	d->cycles = inst->cycles;
+	d->last = ends_block(cpu->memory[pc]);
+
+	// modes whose address only depends on the instruction bytes are worked
+	// out now; the rest are still decoded when they run
+	switch (inst->mode) {
+	case IMM:
+		d->operand = pc+1;
+		break;
+	case ZP:
+		d->operand = operand & 0xFF;
+		break;
+	case ABS:
+		d->operand = operand;
+		break;
+	case REL:
+		d->operand = pc + (int8_t)operand;
+		break;
+	default:
+		d->mode = inst->mode;
+		d->operand = 0;
+		break;
+	}
+}
+
+static Block * find_block(CPU * cpu, uint16_t start)
+{
+	struct BlockCache * cache = cpu->cache;
+	Block * b = slot(cache, start);
+	uint32_t pc = start;
+	int i;
+
+	if (b->valid && b->start == start) return b;
+
+	b->valid = true;
+	b->start = start;
+	for (i = 0; i < BLOCK_MAX; i++) {
+		decode(cpu, pc, &b->insts[i]);
+		pc += b->insts[i].length;
+		if (b->insts[i].last || pc + 3 > 0x10000) break;
+	}
+	if (i == BLOCK_MAX) i--;
+	b->insts[i].last = true;
+	b->insts[i].fusion = NULL;
+	b->end = pc;
+	while (i-- > 0)
+		b->insts[i].fusion = find_fusion(b->insts[i].opcode, b->insts[i + 1].opcode);
+
+	for (pc = start; pc < b->end; pc++)
+		cache->code[pc >> 3] |= 1 << (pc & 7);
+	watch_code(cpu, b->start, b->end);
+	return b;
+}
+
+/* Invalidation */
+
+static void patch_block(CPU * cpu, Block * b, uint16_t addr)
+{
+	struct BlockCache * cache = cpu->cache;
+	uint16_t pc = b->start;
+	DecodedInst * d = b->insts;
+	bool last;
+
+	while (pc + d->length <= addr) pc += d++->length;
+
+	if (pc == addr) {
+		// the opcode itself changed, so the block layout may have too
+		b->valid = false;
+		if (cache->next >= b->insts && cache->next < b->insts + BLOCK_MAX)
+			cache->next = NULL;
+	} else {
+		// only an operand changed (the usual kind of self-modifying code)
+		last = d->last;
+		decode(cpu, pc, d);
+		d->last = last;
+	}
+}
+
+static void invalidate(CPU * cpu, uint16_t addr)
+{
+	struct BlockCache * cache = cpu->cache;
+	int start;
+	Block * b;
+
+	for (start = addr; start >= 0 && start > addr - BLOCK_SPAN; start--) {
+		b = slot(cache, start);
+		if (b->valid && b->start == start && addr < b->end)
+			patch_block(cpu, b, addr);
+	}
+}
+
+void cache_check_write(CPU * cpu, uint16_t addr) // called by the bus for writes to pages holding cached code
+{
+	if (cpu->cache->code[addr >> 3] & (1 << (addr & 7)))
+		invalidate(cpu, addr);
+}
+
+/* Execution */
+
+// options that have to see every instruction, or the PC between them
+#define FUSION_BLOCKERS (RUN_TRACE | RUN_DUMP | RUN_RECORD | RUN_RING | RUN_STUCK | RUN_PROFILE)
+
+int step_cached(CPU * cpu, int verbose) // returns cycle count
+{
+	struct BlockCache * cache = cpu->cache;
+	DecodedInst * d = cache->next;
+	uint64_t start;
+	int cycles;
+
+	if (d == NULL) d = find_block(cpu, cpu->PC)->insts;
+
+	if (verbose) print_state(cpu);
+
+	if (d->fusion && !verbose && !(cpu->run_flags & FUSION_BLOCKERS)) {
+		start = cpu->total_cycles;
+		cache->next = d + 1; // cleared if a write drops this block
+		if (d->fusion(cpu) == 2 && cache->next)
+			cache->next = d[1].last ? NULL : d + 2;
+		return cpu->total_cycles - start;
+	}
+
+	// set before running, so that a write which drops this block can clear it
+	cache->next = d->last ? NULL : d + 1;
+
+	cpu->resolved = d->operand;
+	cpu->jumping = 0;
+	cpu->extra_cycles = 0;
+	d->function(cpu, d->mode);
+	if (cpu->jumping == 0) cpu->PC += d->length;
+
+	// 7 cycle instructions (e.g. ROL $nnnn,X) don't have a penalty cycle for
+	// crossing a page boundary.
+	if (d->cycles == 7) cpu->extra_cycles = 0;
+	COUNT_STEP(cpu, d->opcode);
+
+	cycles = d->cycles + cpu->extra_cycles;
+	cpu->total_cycles += cycles;
+	return cycles;
+}
+
+// The run loop for -B when no option has to see each step (the break address
+// is checked here, the way the fused handlers check it). run_cycles picks it
+// in place of run_loop, so the loop calls step_cached directly, without
+// going through step_cpu's HLE and JIT tests and step_interp for every
+// instruction.
+int run_cached(CPU * cpu) // returns RUN_BREAK or 0, like run_loop
+{
+	while (cpu->total_cycles < cpu->stop) {
+		if (cpu->hle && cpu->hle->slots[cpu->PC] && run_trap(cpu) > 0) continue;
+		step_cached(cpu, 0);
+		if ((cpu->run_flags & RUN_BREAK) && cpu->PC == cpu->break_pc) return RUN_BREAK;
+	}
+	return 0;
+}
+
+/* Setup */
+
+int init_block_cache(CPU * cpu)
+{
+	cpu->cache = calloc(1, sizeof(struct BlockCache));
+	return cpu->cache == NULL ? -1 : 0;
+}
+
+void free_block_cache(CPU * cpu)
+{
+	free(cpu->cache);
+	cpu->cache = NULL;
+}
+
+void flush_block_cache(CPU * cpu) // call after changing memory behind the CPU's back
+{
+	memset(cpu->cache, 0, sizeof(struct BlockCache));
+}
@@ -0,0 +1,39 @@
+#define BLOCK_MAX 16 // instructions per block
+#define BLOCK_SPAN (BLOCK_MAX * 3) // most bytes a block can cover
+#define CACHE_SIZE 4096 // blocks, must be a power of two
+
+typedef struct {
+	void (*function)(CPU * cpu, Mode mode);
+	Mode mode;
+	uint16_t operand; // resolved operand address when mode is RESOLVED
+	uint8_t opcode;
+	uint8_t length;
+	uint8_t cycles;
+	bool last; // the block ends after this instruction
+	Fusion fusion; // runs this instruction and the next as one step, or NULL
+} DecodedInst;
+
+typedef struct {
+	bool valid;
+	uint16_t start; // address of the first instruction
+	uint32_t end; // one past the last byte of the block
+	DecodedInst insts[BLOCK_MAX];
+} Block;
+
+struct BlockCache {
+	Block blocks[CACHE_SIZE]; // direct mapped, keyed by start address
+	uint8_t code[0x10000 / 8]; // one bit per byte covered by a cached block
+	DecodedInst * next; // next entry of the block being run, or NULL
+};
+
+int init_block_cache(CPU * cpu);
+
+void free_block_cache(CPU * cpu);
+
+void flush_block_cache(CPU * cpu);
+
+int step_cached(CPU * cpu, int verbose);
+
+int run_cached(CPU * cpu);
+
+void cache_check_write(CPU * cpu, uint16_t addr);
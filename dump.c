@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "6502.h"
+#include "dump.h"
+
+// Writes to RAM are only seen while its pages are watched, so opening a dump
+// sends every RAM write through write_code, which calls mark_dirty. After
+// that a step that doesn't store anything costs one test.
+
+int open_dump(CPU * cpu, char * filename, char * stream_filename) // either name may be NULL
+{
+	struct Dump * dump = calloc(1, sizeof(struct Dump));
+	int i;
+
+	if (dump == NULL) return -1;
+	dump->fd = -1;
+	if (filename && (dump->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		free(dump);
+		return -1;
+	}
+	if (stream_filename && (dump->stream = fopen(stream_filename, "wb")) == NULL) {
+		if (dump->fd >= 0) close(dump->fd);
+		free(dump);
+		return -1;
+	}
+	if (dump->stream) fwrite(DUMP_MAGIC, 1, sizeof(DUMP_MAGIC) - 1, dump->stream);
+	cpu->dump = dump;
+
+	for (i = 0; i < 0x100; i++) mark_dirty(cpu, i << 8); // the first dump is complete
+	watch_code(cpu, 0, 0x10000);
+	return 0;
+}
+
+void write_dump(CPU * cpu)
+{
+	struct Dump * dump = cpu->dump;
+	bool keyframe = dump->stream && dump->steps == dump->next_keyframe;
+	DumpRecord r = {dump->steps, cpu->total_cycles, keyframe ? 0x100 : dump->num_dirty};
+	uint8_t page;
+	int i;
+
+	if (dump->stream) fwrite(&r, sizeof(r), 1, dump->stream);
+	for (i = 0; i < r.num_pages; i++) {
+		page = keyframe ? i : dump->dirty[i];
+		if (dump->stream) {
+			fputc(page, dump->stream);
+			fwrite(&cpu->memory[page << 8], 0x100, 1, dump->stream);
+		}
+	}
+	for (i = 0; i < dump->num_dirty; i++) {
+		page = dump->dirty[i];
+		if (dump->fd >= 0 && pwrite(dump->fd, &cpu->memory[page << 8], 0x100, page << 8) != 0x100) {
+			fprintf(stderr, "Warning: could not update memdump\n");
+			close(dump->fd);
+			dump->fd = -1;
+		}
+		dump->is_dirty[page] = false;
+	}
+	dump->num_dirty = 0;
+	if (keyframe) dump->next_keyframe = dump->steps + DUMP_KEYFRAME_STEPS;
+}
+
+void close_dump(CPU * cpu)
+{
+	struct Dump * dump = cpu->dump;
+
+	if (dump == NULL) return;
+	if (dump->fd >= 0) close(dump->fd);
+	if (dump->stream) fclose(dump->stream);
+	free(dump);
+	cpu->dump = NULL;
+}
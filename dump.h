@@ -0,0 +1,50 @@
+#define DUMP_MAGIC "6502MEM1"
+#define DUMP_KEYFRAME_STEPS 100000 // steps between full copies of memory in a stream
+
+// A memory stream (-M) is DUMP_MAGIC followed by one DumpRecord for each step
+// that wrote to memory, each followed by the pages it changed. Every
+// DUMP_KEYFRAME_STEPS steps the record holds all 256 pages instead, so
+// memrebuild.py only has to replay from the nearest keyframe.
+typedef struct __attribute__((packed)) {
+	uint64_t step; // steps run before this record was taken
+	uint64_t cycles; // total_cycles
+	uint16_t num_pages; // DumpPages that follow, 0x100 for a keyframe
+} DumpRecord;
+
+typedef struct __attribute__((packed)) {
+	uint8_t page;
+	uint8_t data[0x100];
+} DumpPage;
+
+struct Dump {
+	int fd; // memdump, kept up to date in place, or -1
+	FILE * stream; // memory stream, or NULL
+	uint64_t steps; // steps seen so far
+	uint64_t next_keyframe; // step the next keyframe is due
+	int num_dirty;
+	uint8_t dirty[0x100]; // pages written since the last dump, num_dirty of them
+	bool is_dirty[0x100];
+};
+
+int open_dump(CPU * cpu, char * filename, char * stream_filename);
+
+void close_dump(CPU * cpu);
+
+void write_dump(CPU * cpu);
+
+static inline void mark_dirty(CPU * cpu, uint16_t addr)
+{
+	struct Dump * dump = cpu->dump;
+
+	if (dump->is_dirty[addr >> 8]) return;
+	dump->is_dirty[addr >> 8] = true;
+	dump->dirty[dump->num_dirty++] = addr >> 8;
+}
+
+static inline void dump_memory(CPU * cpu) // called before each step
+{
+	struct Dump * dump = cpu->dump;
+
+	if (dump->num_dirty || (dump->stream && dump->steps == dump->next_keyframe)) write_dump(cpu);
+	dump->steps++;
+}
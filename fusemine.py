@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+
+# Finds the instruction pairs worth fusing in -B's blocks from binary traces
+# written with -t. A pair counts when the second instruction follows the
+# first in memory and the first doesn't end a block, which is when the block
+# cache can run both with one handler. The triples report shows which pairs
+# overlap; only pairs are fused.
+#
+# Overlapping pairs compete: the block cache fuses from the front, so in
+# ROR ROR TYA the ROR, TYA pair never runs fused. The traces are replayed
+# with the top pairs fused that way, and pairs that would run fused for less
+# than -m of the steps are left out of -o's table.
+#
+# usage: fusemine.py [-n NUM] [-m PCT] [-o FILE] TRACE...
+#   -n NUM   pairs to consider (default 32)
+#   -m PCT   fewest steps, in percent, a kept pair has to cover (default 0.1)
+#   -o FILE  write the kept pairs to FILE as FUSION() lines, the format of
+#            fusions.h, which the emulator is built with
+
+import getopt
+import re
+import struct
+import sys
+from collections import Counter
+
+MAGIC = b'6502TRC1'
+RECORD = struct.Struct('<QH3s5B') # cycles, pc, bytes, a, x, y, p, sp; see trace.h
+
+LENGTHS = {
+    'ACC': 1, 'ABS': 3, 'ABSX': 3, 'ABSY': 3, 'IMM': 2, 'IMPL': 1, 'IND': 3,
+    'XIND': 2, 'INDY': 2, 'REL': 2, 'ZP': 2, 'ZPX': 2, 'ZPY': 2, 'JMP_IND_BUG': 3,
+}
+
+ENDS_BLOCK = {0x00, 0x20, 0x40, 0x4C, 0x60, 0x6C} # BRK JSR RTI JMP RTS JMP (); branches too, see cache.c
+
+
+def load_opcodes(path):
+    # the mnemonic, length, whether it ends a block and the OPCODE() arguments, for every opcode
+    table = {}
+    with open(path) as f:
+        for m in re.finditer(r'OPCODE\((0x[0-9A-Fa-f]+), "([^"]*)", (\w+), (\w+), (\d+)\)', f.read()):
+            op = int(m.group(1), 16)
+            table[op] = (m.group(2), LENGTHS[m.group(4)], op in ENDS_BLOCK or m.group(4) == 'REL',
+                         '0x%02X, %s, %s, %s' % (op, m.group(3), m.group(4), m.group(5)))
+    return table
+
+
+def steps(path):
+    # (pc, opcode) of each step in a trace
+    with open(path, 'rb') as f:
+        if f.read(len(MAGIC)) != MAGIC:
+            sys.exit('%s is not a trace file' % path)
+        while True:
+            chunk = f.read(RECORD.size * 65536)
+            if not chunk:
+                break
+            for _, pc, code, _, _, _, _, _ in RECORD.iter_unpack(chunk):
+                yield pc, code[0]
+
+
+def mine(path, opcodes, pairs, triples):
+    n = 0
+    prev = prev2 = None # (pc, opcode) of the last two steps, while they run on in sequence
+    for pc, op in steps(path):
+        n += 1
+        if prev is not None:
+            _, length, ends, _ = opcodes[prev[1]]
+            if not ends and (prev[0] + length) & 0xFFFF == pc:
+                pairs[prev[1], op] += 1
+                if prev2 is not None:
+                    triples[prev2[1], prev[1], op] += 1
+            else:
+                prev = None
+        prev2, prev = prev, (pc, op)
+    return n
+
+
+def replay(path, opcodes, fused, fires):
+    # counts how often each pair in fused runs fused, pairing from the front like the block cache
+    prev = None # (pc, opcode) of the last step, unless it ran as the second of a fused pair
+    for pc, op in steps(path):
+        if prev is not None:
+            _, length, ends, _ = opcodes[prev[1]]
+            if not ends and (prev[0] + length) & 0xFFFF == pc and (prev[1], op) in fused:
+                fires[prev[1], op] += 1
+                prev = None
+                continue
+        prev = (pc, op)
+
+
+def name(opcodes, ops):
+    return ', '.join(opcodes[op][0] for op in ops)
+
+
+def main():
+    opts, args = getopt.getopt(sys.argv[1:], 'n:m:o:')
+    opts = dict(opts)
+    if not args:
+        sys.exit('usage: fusemine.py [-n NUM] [-m PCT] [-o FILE] TRACE...')
+    keep = int(opts.get('-n', 32))
+    least = float(opts.get('-m', 0.1))
+    opcodes = load_opcodes(sys.path[0] + '/opcodes.h')
+
+    pairs, triples = Counter(), Counter()
+    total = sum(mine(path, opcodes, pairs, triples) for path in args)
+
+    fires = Counter()
+    for path in args:
+        replay(path, opcodes, set(ops for ops, _ in pairs.most_common(keep)), fires)
+    kept = [ops for ops, _ in pairs.most_common(keep) if 100.0 * fires[ops] / total >= least]
+
+    print('%d steps, %d in fusable pairs' % (total, sum(pairs.values())))
+    print('\npairs (in sequence, run fused):')
+    for ops, n in pairs.most_common(keep):
+        print('  %02X %02X  %10d  %5.2f%%  %5.2f%%  %s%s' % (ops + (n, 100.0 * n / total, 100.0 * fires[ops] / total,
+                                                         name(opcodes, ops), '' if ops in kept else ' (dropped)')))
+    print('\ntriples:')
+    for ops, n in triples.most_common(keep // 2):
+        print('  %02X %02X %02X  %10d  %5.2f%%  %s' % (ops + (n, 100.0 * n / total, name(opcodes, ops))))
+
+    if '-o' in opts:
+        with open(opts['-o'], 'w') as out:
+            out.write('// the %d of the %d most frequent pairs in %s that run fused for at least %g%%\n'
+                      % (len(kept), keep, ' '.join(args), least))
+            out.write('// of the steps, written by fusemine.py\n')
+            out.write('// FUSION(op, name, mode, cycles, op, name, mode, cycles), as in opcodes.h\n')
+            for ops in kept:
+                out.write('FUSION(%s, %s) // %s\n' % (opcodes[ops[0]][3], opcodes[ops[1]][3], name(opcodes, ops)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,32 @@
+// the 28 of the 32 most frequent pairs in a -t trace of ehBASIC running
+// examples/mandelbrot.bas (-I -c 60000000) that run fused for at least 0.1%
+// of the steps, written by fusemine.py -o
+// FUSION(op, name, mode, cycles, op, name, mode, cycles), as in opcodes.h
+FUSION(0x18, CLC, IMPL, 2, 0xA5, LDA, ZP, 3) // CLC impl, LDA zpg
+FUSION(0xD1, CMP, INDY, 5, 0xD0, BNE, REL, 2) // CMP ind,Y, BNE rel
+FUSION(0x66, ROR, ZP, 5, 0x66, ROR, ZP, 5) // ROR zpg, ROR zpg
+FUSION(0xC5, CMP, ZP, 3, 0xF0, BEQ, REL, 2) // CMP zpg, BEQ rel
+FUSION(0x85, STA, ZP, 3, 0xE4, CPX, ZP, 3) // STA zpg, CPX zpg
+FUSION(0xA5, LDA, ZP, 3, 0xD1, CMP, INDY, 5) // LDA zpg, CMP ind,Y
+FUSION(0x69, ADC, IMM, 2, 0x90, BCC, REL, 2) // ADC #, BCC rel
+FUSION(0xC9, CMP, IMM, 2, 0xF0, BEQ, REL, 2) // CMP #, BEQ rel
+FUSION(0x65, ADC, ZP, 3, 0x85, STA, ZP, 3) // ADC zpg, STA zpg
+FUSION(0x85, STA, ZP, 3, 0xA5, LDA, ZP, 3) // STA zpg, LDA zpg
+FUSION(0xA5, LDA, ZP, 3, 0x65, ADC, ZP, 3) // LDA zpg, ADC zpg
+FUSION(0xC9, CMP, IMM, 2, 0xB0, BCS, REL, 2) // CMP #, BCS rel
+FUSION(0x38, SEC, IMPL, 2, 0xE9, SBC, IMM, 2) // SEC impl, SBC #
+FUSION(0xAD, LDA, ABS, 4, 0xC9, CMP, IMM, 2) // LDA abs, CMP #
+FUSION(0xE6, INC, ZP, 5, 0xD0, BNE, REL, 2) // INC zpg, BNE rel
+FUSION(0xA8, TAY, IMPL, 2, 0x90, BCC, REL, 2) // TAY impl, BCC rel
+FUSION(0x98, TYA, IMPL, 2, 0x4A, LSR, ACC, 2) // TYA impl, LSR A
+FUSION(0xB1, LDA, INDY, 5, 0x85, STA, ZP, 3) // LDA ind,Y, STA zpg
+FUSION(0x85, STA, ZP, 3, 0x84, STY, ZP, 3) // STA zpg, STY zpg
+FUSION(0xC9, CMP, IMM, 2, 0xD0, BNE, REL, 2) // CMP #, BNE rel
+FUSION(0x26, ROL, ZP, 5, 0x26, ROL, ZP, 5) // ROL zpg, ROL zpg
+FUSION(0x68, PLA, IMPL, 4, 0x85, STA, ZP, 3) // PLA impl, STA zpg
+FUSION(0xE9, SBC, IMM, 2, 0x38, SEC, IMPL, 2) // SBC #, SEC impl
+FUSION(0xE9, SBC, IMM, 2, 0x60, RTS, IMPL, 6) // SBC #, RTS impl
+FUSION(0xA5, LDA, ZP, 3, 0x48, PHA, IMPL, 3) // LDA zpg, PHA impl
+FUSION(0x88, DEY, IMPL, 2, 0xB1, LDA, INDY, 5) // DEY impl, LDA ind,Y
+FUSION(0xD1, CMP, INDY, 5, 0xF0, BEQ, REL, 2) // CMP ind,Y, BEQ rel
+FUSION(0xA9, LDA, IMM, 2, 0x85, STA, ZP, 3) // LDA #, STA zpg
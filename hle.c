@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "cache.h"
+#include "hle.h"
+
+// High level emulation of known ROM routines. Each build of a ROM that has
+// native routines is recognized by a hash of its image, and reaching the
+// first instruction of one of its routines runs a C version instead, which
+// leaves memory, the registers and the flags as the guest code would and
+// carries on at the same place. By default the cycles the guest code would
+// have taken are worked out and charged as well, so a run with traps keeps
+// the same timing.
+//
+// The native versions only deal with plain RAM; when the guest code would
+// touch anything else, or decimal mode would change what ADC does, they
+// leave the call to the guest code, as they do when the routine's bytes have
+// been overwritten since the build was recognized.
+
+typedef struct { // what -E saves and compares
+	uint16_t pc;
+	uint8_t a, x, y, sp;
+	uint8_t sr; // as get_sr returns it
+	union StatusReg raw_sr; // the rest is only for putting the registers back
+	uint16_t nz;
+	uint8_t carry, v;
+} Regs;
+
+/* Guest Access */
+
+static inline bool plain(CPU * cpu, uint16_t addr) // the guest reads memory[addr] directly
+{
+	return cpu->pages[addr >> 8].read == &cpu->memory[addr & 0xFF00];
+}
+
+static inline uint8_t peek(CPU * cpu, uint16_t addr) // only for addresses that pass plain()
+{
+	return cpu->memory[addr];
+}
+
+static inline void poke(CPU * cpu, uint16_t addr, uint8_t val) // through the bus, so writes over cached or compiled code are seen
+{
+	Page * page = &cpu->pages[addr >> 8];
+
+	if (page->write) page->write[addr & 0xFF] = val;
+	else page->write_handler(page->device, addr, val);
+}
+
+static inline void rts(CPU * cpu)
+{
+	uint16_t lo = peek(cpu, 0x100 + (uint8_t)(cpu->SP + 1)), hi = peek(cpu, 0x100 + (uint8_t)(cpu->SP + 2));
+
+	cpu->SP += 2;
+	cpu->PC = (lo | hi << 8) + 1;
+}
+
+/* ehBASIC 2.22 */
+
+// Simple variable lookup (LDA #0 at $CDF0). Walks the 6 byte entries from
+// $7B/$7C up to $7D/$7E looking for the name in $93/$94, with ($AA) pointing
+// at each in turn, and comes out at $CE7C on a match or $CE32 at the end of
+// the table. This is where ehBASIC spends most of its time in programs with
+// more than a handful of variables.
+static int find_var(CPU * cpu)
+{
+	uint16_t entry, end;
+	uint8_t lo, hi, v = cpu->v;
+	unsigned int tmp;
+	int cycles = 16; // LDA #0 to LDY #0, and STX $AB
+
+	if (cpu->SR.bits.decimal || !plain(cpu, 0x00)) return 0;
+	entry = peek(cpu, 0x7B) | peek(cpu, 0x7C) << 8;
+	end = peek(cpu, 0x7D) | peek(cpu, 0x7E) << 8;
+	if (entry < 0x100 || end < entry || (end - entry) % 6 != 0) return 0; // the table would cover ($AA), or never end
+	for (;;) {
+		lo = entry & 0xFF;
+		hi = entry >> 8;
+		cycles += 6; // STA $AA, CPX $7E
+		if (entry == end) {
+			cycles += 8; // BNE, CMP $7D, BEQ taken
+			cpu->PC = 0xCE32;
+			cpu->A = lo;
+			cpu->Y = 0;
+			break;
+		}
+		cycles += hi == end >> 8 ? 7 : 3;
+		if (!plain(cpu, entry) || !plain(cpu, entry + 1)) return 0;
+		cycles += 8; // LDA $93, CMP ($AA),Y
+		if (peek(cpu, entry) != peek(cpu, 0x93)) {
+			cycles += 3;
+		} else {
+			cycles += 12 + (lo == 0xFF); // BNE, LDA $94, INY, CMP ($AA),Y
+			if (peek(cpu, entry + 1) == peek(cpu, 0x94)) {
+				cycles += 3;
+				cpu->PC = 0xCE7C;
+				cpu->A = peek(cpu, 0x94);
+				cpu->Y = 1;
+				break;
+			}
+			cycles += 4; // BEQ, DEY
+		}
+		tmp = lo + 6;
+		v = (lo ^ tmp) & (6 ^ tmp); // ADC #6
+		cycles += 7 + (tmp > 0xFF ? 11 : 4); // CLC, LDA $AA, ADC #6, and BCC or BCC, INX, BNE, STX $AB
+		entry += 6;
+	}
+	poke(cpu, 0x61, 0);
+	poke(cpu, 0xAA, lo);
+	poke(cpu, 0xAB, hi);
+	cpu->X = hi;
+	cpu->nz = 0; // equal, from CMP $7D or CMP ($AA),Y
+	cpu->carry = 1;
+	cpu->v = v;
+	return cycles;
+}
+
+// One byte of the floating point multiply (LSR A at $D765). Adds FAC2's
+// mantissa ($B4-$B6) into the partial product ($75-$77, with $B9 catching
+// the bits shifted out) once for each bit of A, shifting right each time.
+static int mul_byte(CPU * cpu)
+{
+	uint32_t p, m;
+	unsigned int tmp;
+	uint8_t b9, carry;
+	int cycles = 4 + 6, k; // LSR A, ORA #$80, and RTS
+
+	if (cpu->SR.bits.decimal || !plain(cpu, 0x00) || !plain(cpu, 0x1FF)) return 0;
+	m = peek(cpu, 0xB4) << 16 | peek(cpu, 0xB5) << 8 | peek(cpu, 0xB6);
+	p = peek(cpu, 0x75) << 16 | peek(cpu, 0x76) << 8 | peek(cpu, 0x77);
+	b9 = peek(cpu, 0xB9);
+	for (k = 0; k < 8; k++) {
+		cycles += 26 + (k < 7 ? 3 : 2); // TAY, the RORs, TYA, LSR A, and BNE
+		if ((cpu->A >> k) & 1) {
+			tmp = (p >> 16) + (m >> 16) + (((p & 0xFFFF) + (m & 0xFFFF)) >> 16); // the last ADC
+			cpu->v = ((p >> 16) ^ tmp) & ((m >> 16) ^ tmp);
+			p += m;
+			carry = p >> 24;
+			p &= 0xFFFFFF;
+			cycles += 31;
+		} else {
+			carry = 0;
+			cycles += 3;
+		}
+		b9 = b9 >> 1 | (p & 1) << 7;
+		p = p >> 1 | carry << 23;
+	}
+	poke(cpu, 0x75, p >> 16);
+	poke(cpu, 0x76, p >> 8);
+	poke(cpu, 0x77, p);
+	poke(cpu, 0xB9, b9);
+	cpu->A = 0;
+	cpu->Y = 1;
+	cpu->nz = 0; // from the LSR A that ends the loop
+	cpu->carry = 1;
+	rts(cpu);
+	return cycles;
+}
+
+static const Trap ehbasic_traps[] = {
+	{ "find_var", 0xCDF0, 0xCE1E, find_var },
+	{ "mul_byte", 0xD765, 0xD78B, mul_byte },
+};
+
+static const Build builds[] = {
+	{ "ehBASIC 2.22", 0xC000, 0x4000, 0x3C5B6C01D6C7A5B3, ehbasic_traps, sizeof(ehbasic_traps) / sizeof(Trap) },
+};
+
+/* Traps */
+
+static uint64_t fnv1a(const uint8_t * data, size_t size)
+{
+	uint64_t hash = 0xCBF29CE484222325;
+	size_t i;
+
+	for (i = 0; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3;
+	return hash;
+}
+
+static void save_regs(CPU * cpu, Regs * r)
+{
+	*r = (Regs) {cpu->PC, cpu->A, cpu->X, cpu->Y, cpu->SP, get_sr(cpu), cpu->SR, cpu->nz, cpu->carry, cpu->v};
+}
+
+static void load_regs(CPU * cpu, Regs * r)
+{
+	cpu->PC = r->pc;
+	cpu->A = r->a;
+	cpu->X = r->x;
+	cpu->Y = r->y;
+	cpu->SP = r->sp;
+	cpu->SR = r->raw_sr;
+	cpu->nz = r->nz;
+	cpu->carry = r->carry;
+	cpu->v = r->v;
+}
+
+// Runs the native routine, then puts everything back and runs the guest
+// code until it gets to where the native routine left off, and reports any
+// difference. The guest code's results are the ones kept.
+static int verify_trap(CPU * cpu, const Trap * trap, TrapStats * stats)
+{
+	struct Hle * hle = cpu->hle;
+	Regs entry, native, guest;
+	uint64_t start = cpu->total_cycles;
+	int cycles, steps, addr;
+	bool differs;
+
+	save_regs(cpu, &entry);
+	memcpy(hle->before, cpu->memory, MEMORY_SIZE);
+	cycles = trap->native(cpu);
+	if (cycles == 0) return 0;
+	save_regs(cpu, &native);
+	memcpy(hle->after, cpu->memory, MEMORY_SIZE);
+	memcpy(cpu->memory, hle->before, MEMORY_SIZE);
+	load_regs(cpu, &entry);
+
+	cpu->hle = NULL; // so the trap doesn't fire again
+	for (steps = 0; steps < HLE_VERIFY_STEPS && (steps == 0 || cpu->PC != native.pc || cpu->SP != native.sp); steps++)
+		step_cpu(cpu, 0);
+	cpu->hle = hle;
+	save_regs(cpu, &guest);
+
+	stats->calls++;
+	addr = MEMORY_SIZE;
+	if (memcmp(hle->after, cpu->memory, MEMORY_SIZE) != 0)
+		for (addr = 0; hle->after[addr] == cpu->memory[addr]; addr++);
+	differs = native.pc != guest.pc || native.a != guest.a || native.x != guest.x || native.y != guest.y
+		|| native.sp != guest.sp || native.sr != guest.sr || addr < MEMORY_SIZE
+		|| (hle->cost == 0 && (uint64_t)cycles != cpu->total_cycles - start);
+	if (!differs) return cpu->total_cycles - start;
+	if (stats->differed++ < HLE_MAX_REPORTS) {
+		fprintf(stderr, "hle: %s (call %llu) differs from the guest code, native/guest:", trap->name,
+			(unsigned long long)stats->calls);
+		if (native.pc != guest.pc) fprintf(stderr, " PC %04x/%04x", native.pc, guest.pc);
+		if (native.a != guest.a) fprintf(stderr, " A %02x/%02x", native.a, guest.a);
+		if (native.x != guest.x) fprintf(stderr, " X %02x/%02x", native.x, guest.x);
+		if (native.y != guest.y) fprintf(stderr, " Y %02x/%02x", native.y, guest.y);
+		if (native.sp != guest.sp) fprintf(stderr, " SP %02x/%02x", native.sp, guest.sp);
+		if (native.sr != guest.sr) fprintf(stderr, " P %02x/%02x", native.sr, guest.sr);
+		if (addr < MEMORY_SIZE) fprintf(stderr, " $%04x %02x/%02x", addr, hle->after[addr], cpu->memory[addr]);
+		if (hle->cost == 0 && (uint64_t)cycles != cpu->total_cycles - start)
+			fprintf(stderr, " cycles %d/%llu", cycles, (unsigned long long)(cpu->total_cycles - start));
+		fprintf(stderr, "\n");
+	}
+	return cpu->total_cycles - start;
+}
+
+int run_trap(CPU * cpu) // returns the cycles it ran for, or 0 if the guest code has to run
+{
+	struct Hle * hle = cpu->hle;
+	const Trap * trap = &hle->build->traps[hle->slots[cpu->PC] - 1];
+	TrapStats * stats = &hle->stats[trap - hle->build->traps];
+	int cycles;
+
+	if (memcmp(&cpu->memory[trap->pc], &hle->code[trap->pc], trap->end - trap->pc) != 0) return 0;
+	if (cpu->cache) cpu->cache->next = NULL; // the block being run is left part way through
+	if (hle->verify) return verify_trap(cpu, trap, stats);
+	if ((cycles = trap->native(cpu)) == 0) return 0;
+	if (hle->cost) cycles = hle->cost;
+	cpu->total_cycles += cycles;
+	stats->calls++;
+	return cycles;
+}
+
+// Looks for a build that memory holds and sets up its traps. Leaves
+// cpu->hle NULL when there's none.
+int init_hle(CPU * cpu, uint32_t cost, bool verify)
+{
+	const Build * build;
+	int i;
+
+	for (build = builds; build < builds + sizeof(builds) / sizeof(Build); build++)
+		if (fnv1a(&cpu->memory[build->start], build->size) == build->hash) break;
+	if (build == builds + sizeof(builds) / sizeof(Build)) return 0;
+
+	cpu->hle = calloc(1, sizeof(struct Hle));
+	if (cpu->hle == NULL) return -1;
+	cpu->hle->build = build;
+	cpu->hle->cost = cost;
+	cpu->hle->verify = verify;
+	memcpy(cpu->hle->code, cpu->memory, MEMORY_SIZE);
+	for (i = 0; i < build->num_traps && i < HLE_MAX_TRAPS; i++)
+		cpu->hle->slots[build->traps[i].pc] = i + 1;
+	return 0;
+}
+
+void free_hle(CPU * cpu)
+{
+	struct Hle * hle = cpu->hle;
+	int i;
+
+	if (hle == NULL) return;
+	for (i = 0; hle->verify && i < hle->build->num_traps; i++)
+		fprintf(stderr, "hle: %s: %llu calls checked, %llu differed\n", hle->build->traps[i].name,
+			(unsigned long long)hle->stats[i].calls, (unsigned long long)hle->stats[i].differed);
+	free(hle);
+	cpu->hle = NULL;
+}
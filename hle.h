@@ -0,0 +1,43 @@
+#define HLE_MAX_TRAPS 16 // native routines per ROM build
+#define HLE_VERIFY_STEPS 1000000 // most guest instructions -E runs to catch up with a native routine
+#define HLE_MAX_REPORTS 10 // differences reported per routine before -E goes quiet
+
+// a guest routine with a native version: reaching pc runs native instead
+typedef struct {
+	const char * name;
+	uint16_t pc;
+	uint16_t end; // one past the last byte of guest code the routine covers; it has to be unchanged
+	int (*native)(CPU * cpu); // returns the cycles the guest code would have taken, or 0 to leave it to the guest code
+} Trap;
+
+// a ROM image the traps are written for, recognized by its hash
+typedef struct {
+	const char * name;
+	uint16_t start;
+	uint32_t size;
+	uint64_t hash; // 64 bit FNV-1a of memory[start, start + size)
+	const Trap * traps;
+	int num_traps;
+} Build;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t differed; // -E only
+} TrapStats;
+
+struct Hle {
+	uint8_t slots[0x10000]; // 1 + index into build->traps for each address, 0 where there's no trap
+	const Build * build;
+	TrapStats stats[HLE_MAX_TRAPS];
+	uint32_t cost; // cycles charged per native call, or 0 for what the guest code takes
+	bool verify; // run the guest code as well and compare
+	uint8_t code[MEMORY_SIZE]; // memory as it was when the build was recognized
+	uint8_t before[MEMORY_SIZE]; // -E scratch
+	uint8_t after[MEMORY_SIZE];
+};
+
+int init_hle(CPU * cpu, uint32_t cost, bool verify);
+
+void free_hle(CPU * cpu);
+
+int run_trap(CPU * cpu);
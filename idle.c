@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "idle.h"
+
+// A loop that polls a device is idle when each pass through it leaves the
+// machine exactly as it found it: the same registers at the poll, the same
+// value from the device, the same memory, and the same number of cycles
+// between polls. Until the device returns something else, running it only
+// moves total_cycles on, so idle_poll does that directly, in whole passes,
+// up to the next event or interrupt. Repeating a read that returned the same value is
+// taken to have no further effect on the device.
+
+// options that have to see every instruction
+#define IDLE_BLOCKERS (RUN_TRACE | RUN_DUMP | RUN_RECORD | RUN_RING | RUN_PROFILE)
+
+void idle_poll(CPU * cpu, uint16_t addr, uint8_t val) // called by the bus after each device read
+{
+	struct Idle * idle = cpu->idle;
+	Poll p = {cpu->PC, addr, cpu->A, cpu->X, cpu->Y, cpu->SP, get_sr(cpu), val};
+	uint64_t period = cpu->total_cycles - idle->last_cycles;
+	uint64_t passes;
+
+	if (cpu->run_flags & IDLE_BLOCKERS) return;
+
+	if (memcmp(&p, &idle->last, sizeof(p)) != 0 || period != idle->period || period > IDLE_MAX_PERIOD) {
+		idle->matches = 0;
+	} else if (++idle->matches == IDLE_POLLS) {
+		memcpy(idle->memory, cpu->memory, MEMORY_SIZE);
+	} else if (idle->matches > IDLE_POLLS) {
+		if (memcmp(idle->memory, cpu->memory, MEMORY_SIZE) != 0) {
+			idle->matches = 0;
+		} else {
+			passes = cpu->stop > cpu->total_cycles ? (cpu->stop - cpu->total_cycles) / period : 0;
+			cpu->total_cycles += passes * period;
+			idle->skipped += passes * period;
+		}
+	}
+	idle->last = p;
+	idle->period = period;
+	idle->last_cycles = cpu->total_cycles;
+}
+
+int init_idle(CPU * cpu)
+{
+	cpu->idle = calloc(1, sizeof(struct Idle));
+	return cpu->idle == NULL ? -1 : 0;
+}
+
+void free_idle(CPU * cpu)
+{
+	free(cpu->idle);
+	cpu->idle = NULL;
+}
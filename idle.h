@@ -0,0 +1,29 @@
+#define IDLE_POLLS 4 // identical polls in a row before a loop is checked for side effects
+#define IDLE_MAX_PERIOD 256 // cycles; longer loops are left alone
+
+// what a polling loop looks like at the moment it reads a device
+typedef struct {
+	uint16_t pc;
+	uint16_t addr;
+	uint8_t a;
+	uint8_t x;
+	uint8_t y;
+	uint8_t sp;
+	uint8_t sr;
+	uint8_t val; // what the device returned
+} Poll;
+
+struct Idle {
+	Poll last;
+	uint64_t last_cycles; // total_cycles at the last poll
+	uint64_t period; // cycles between the last two polls
+	int matches; // polls in a row that matched the one before, a period apart
+	uint64_t skipped; // cycles fast-forwarded over
+	uint8_t memory[MEMORY_SIZE]; // taken after IDLE_POLLS matches, to catch loops that write
+};
+
+int init_idle(CPU * cpu);
+
+void free_idle(CPU * cpu);
+
+void idle_poll(CPU * cpu, uint16_t addr, uint8_t val);
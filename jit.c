@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "6502.h"
+#include "jit.h"
+
+#ifdef __x86_64__
+
+/* x86-64 Code Generation */
+
+// Compiled blocks are called as int block(CPU * cpu, uint8_t * memory,
+// JitTables * tables) and return the number of cycles they ran. Inside a block
+// the guest registers live in host registers and are written back on exit.
+
+enum {
+	RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7,
+	R8 = 8, R9 = 9, R10 = 10, R11 = 11,
+};
+
+#define REG_A R8
+#define REG_X R9
+#define REG_Y R10
+#define REG_SR R11
+#define REG_CPU RDI
+#define REG_MEM RSI
+#define REG_TABLES RDX
+
+// x86 condition codes, for jcc
+#define CC_Z 0x4
+#define CC_NZ 0x5
+
+#define STUB_MAX 96 // bytes in the longest exit stub
+#define INST_MAX 256 // bytes of host code one guest instruction can need
+
+typedef struct {
+	uint8_t * p;
+} Emitter;
+
+typedef enum {
+	UNSUPPORTED, // nothing emitted; the interpreter runs this instruction
+	CONTINUE,
+	END, // the instruction left the block
+} Result;
+
+static inline void emit8(Emitter * e, uint8_t byte)
+{
+	*e->p++ = byte;
+}
+
+static inline void emit16(Emitter * e, uint16_t val)
+{
+	memcpy(e->p, &val, sizeof(val));
+	e->p += sizeof(val);
+}
+
+static inline void emit32(Emitter * e, uint32_t val)
+{
+	memcpy(e->p, &val, sizeof(val));
+	e->p += sizeof(val);
+}
+
+static void emit_rex(Emitter * e, int w, int reg, int rm)
+{
+	int rex = 0x40 | (w ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+	if (rex != 0x40) emit8(e, rex);
+}
+
+static void emit_op(Emitter * e, int op1, int op2)
+{
+	emit8(e, op1);
+	if (op2 >= 0) emit8(e, op2);
+}
+
+// op reg, [base + disp32]
+static void mem_op(Emitter * e, int w, int op1, int op2, int reg, int base, uint32_t disp)
+{
+	emit_rex(e, w, reg, base);
+	emit_op(e, op1, op2);
+	emit8(e, 0x80 | (reg & 7) << 3 | (base & 7));
+	emit32(e, disp);
+}
+
+// op rm, reg
+static void reg_op(Emitter * e, int w, int op1, int op2, int reg, int rm)
+{
+	emit_rex(e, w, reg, rm);
+	emit_op(e, op1, op2);
+	emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void mov_imm(Emitter * e, int reg, uint32_t val)
+{
+	emit_rex(e, 0, 0, reg);
+	emit8(e, 0xB8 + (reg & 7));
+	emit32(e, val);
+}
+
+static void alu8_imm(Emitter * e, int ext, int reg, uint8_t val) // 80 /ext ib
+{
+	reg_op(e, 0, 0x80, -1, ext, reg);
+	emit8(e, val);
+}
+
+static uint8_t * jcc8(Emitter * e, int cc) // returns the displacement to patch
+{
+	emit8(e, 0x70 + cc);
+	emit8(e, 0);
+	return e->p - 1;
+}
+
+static void patch8(Emitter * e, uint8_t * disp)
+{
+	*disp = e->p - (disp + 1);
+}
+
+static void set_nz(Emitter * e, int reg)
+{
+	alu8_imm(e, 4, REG_SR, 0x7D); // and sr, ~(N|Z)
+	reg_op(e, 0, 0x0F, 0xB6, RAX, reg); // movzx eax, reg8
+	emit8(e, 0x44); // or sr, [tables + rax]
+	emit8(e, 0x0A);
+	emit8(e, 0x1C);
+	emit8(e, 0x02);
+}
+
+static void emit_exit(Emitter * e, uint16_t pc, int cycles, int wrote, uint16_t addr)
+{
+	mem_op(e, 0, 0x88, -1, REG_A, REG_CPU, offsetof(CPU, A));
+	mem_op(e, 0, 0x88, -1, REG_X, REG_CPU, offsetof(CPU, X));
+	mem_op(e, 0, 0x88, -1, REG_Y, REG_CPU, offsetof(CPU, Y));
+	mem_op(e, 0, 0x88, -1, REG_SR, REG_CPU, offsetof(CPU, SR));
+	emit8(e, 0x66); // mov word [cpu + PC], pc
+	mem_op(e, 0, 0xC7, -1, 0, REG_CPU, offsetof(CPU, PC));
+	emit16(e, pc);
+	mem_op(e, 1, 0x81, -1, 0, REG_CPU, offsetof(CPU, total_cycles)); // add
+	emit32(e, cycles);
+	if (wrote) { // let run_jit drop the code that was written over
+		mem_op(e, 0, 0xC7, -1, 0, REG_TABLES, offsetof(JitTables, written)); // mov dword
+		emit32(e, addr);
+	}
+	mov_imm(e, RAX, cycles);
+	emit8(e, 0xC3); // ret
+}
+
+static void check_smc(Emitter * e, uint16_t addr, uint16_t next_pc, int cycles)
+{
+	uint8_t * skip;
+
+	// test byte [tables + code + addr/8], bit
+	mem_op(e, 0, 0xF6, -1, 0, REG_TABLES, offsetof(JitTables, code) + (addr >> 3));
+	emit8(e, 1 << (addr & 7));
+	skip = jcc8(e, CC_Z);
+	emit_exit(e, next_pc, cycles, 1, addr);
+	patch8(e, skip);
+}
+
+static void load_operand(Emitter * e, int reg, Mode mode, uint16_t operand)
+{
+	if (mode == IMM)
+		mov_imm(e, reg, operand & 0xFF);
+	else
+		mem_op(e, 0, 0x0F, 0xB6, reg, REG_MEM, operand); // movzx
+}
+
+static int guest_reg(char c)
+{
+	return c == 'A' ? REG_A : c == 'X' ? REG_X : REG_Y;
+}
+
+static Result emit_inst(CPU * cpu, Emitter * e, uint16_t pc, int cycles)
+{
+	Instruction * inst = &instructions[cpu->memory[pc]];
+	char * name = inst->mnemonic;
+	Mode mode = inst->mode;
+	uint16_t next_pc = pc + lengths[mode];
+	uint16_t operand = 0;
+	uint8_t * skip;
+	int reg, taken;
+
+	switch (mode) {
+	case IMPL:
+		break;
+	case IMM:
+	case REL:
+		operand = cpu->memory[(uint16_t)(pc+1)];
+		break;
+	case ZP:
+		operand = cpu->memory[(uint16_t)(pc+1)];
+		if (!is_ram(cpu, 0)) return UNSUPPORTED;
+		break;
+	case ABS:
+		operand = cpu->memory[(uint16_t)(pc+1)] | (cpu->memory[(uint16_t)(pc+2)] << 8);
+		if (!is_ram(cpu, operand >> 8) && strcmp(name, "JMP abs") != 0) return UNSUPPORTED;
+		break;
+	default:
+		return UNSUPPORTED;
+	}
+	cycles += inst->cycles;
+
+	if (!strncmp(name, "LD", 2)) {
+		reg = guest_reg(name[2]);
+		load_operand(e, reg, mode, operand);
+		set_nz(e, reg);
+	} else if (!strncmp(name, "ST", 2) && mode != IMPL) {
+		mem_op(e, 0, 0x88, -1, guest_reg(name[2]), REG_MEM, operand);
+		check_smc(e, operand, next_pc, cycles);
+	} else if (!strncmp(name, "AND", 3) || !strncmp(name, "ORA", 3) || !strncmp(name, "EOR", 3)) {
+		// ext for 80 /ext ib, and the matching op r8, r/m8 opcode
+		int ext = name[0] == 'A' ? 4 : name[0] == 'O' ? 1 : 6;
+		int op = name[0] == 'A' ? 0x22 : name[0] == 'O' ? 0x0A : 0x32;
+		if (mode == IMM)
+			alu8_imm(e, ext, REG_A, operand);
+		else
+			mem_op(e, 0, op, -1, REG_A, REG_MEM, operand);
+		set_nz(e, REG_A);
+	} else if (!strncmp(name, "CMP", 3) || !strncmp(name, "CPX", 3) || !strncmp(name, "CPY", 3)) {
+		reg_op(e, 0, 0x89, -1, guest_reg(name[1] == 'M' ? 'A' : name[2]), RAX); // mov eax, reg
+		if (mode == IMM) {
+			emit8(e, 0x2C); // sub al, imm8
+			emit8(e, operand);
+		} else {
+			mem_op(e, 0, 0x2A, -1, RAX, REG_MEM, operand); // sub al, [mem]
+		}
+		reg_op(e, 0, 0x0F, 0x93, 0, RCX); // setae cl
+		alu8_imm(e, 4, REG_SR, 0x7C); // and sr, ~(N|Z|C)
+		reg_op(e, 0, 0x08, -1, RCX, REG_SR); // or sr, cl
+		set_nz(e, RAX);
+	} else if ((!strncmp(name, "INC", 3) || !strncmp(name, "DEC", 3)) && mode != IMPL) {
+		mem_op(e, 0, 0xFE, -1, name[0] == 'I' ? 0 : 1, REG_MEM, operand);
+		mem_op(e, 0, 0x0F, 0xB6, RAX, REG_MEM, operand);
+		set_nz(e, RAX);
+		check_smc(e, operand, next_pc, cycles);
+	} else if (!strncmp(name, "IN", 2) || !strncmp(name, "DE", 2)) { // INX, INY, DEX, DEY
+		reg = guest_reg(name[2]);
+		reg_op(e, 0, 0xFE, -1, name[0] == 'I' ? 0 : 1, reg);
+		set_nz(e, reg);
+	} else if (name[0] == 'T' && name[1] != 'S' && name[2] != 'S') { // TAX, TAY, TXA, TYA
+		reg = guest_reg(name[2]);
+		reg_op(e, 0, 0x89, -1, guest_reg(name[1]), reg);
+		set_nz(e, reg);
+	} else if (!strncmp(name, "CL", 2) || !strncmp(name, "SE", 2)) {
+		static const char flags[] = "C\1D\10V\100I\4";
+		char * flag = strchr(flags, name[2]);
+		if (flag == NULL || name[2] == 'I') return UNSUPPORTED; // leave interrupt masking to the interpreter
+		if (name[0] == 'C')
+			alu8_imm(e, 4, REG_SR, ~flag[1]);
+		else
+			alu8_imm(e, 1, REG_SR, flag[1]);
+	} else if (!strcmp(name, "NOP impl")) {
+		// nothing
+	} else if (!strncmp(name, "ADC", 3) || !strncmp(name, "SBC", 3)) {
+		// decimal mode is left to the interpreter
+		reg_op(e, 0, 0xF6, -1, 0, REG_SR); // test sr, D
+		emit8(e, 0x08);
+		skip = jcc8(e, CC_Z);
+		emit_exit(e, pc, cycles - inst->cycles, 0, 0);
+		patch8(e, skip);
+
+		load_operand(e, RCX, mode, operand);
+		if (name[0] == 'S') { // binary SBC is ADC of the complement
+			reg_op(e, 0, 0x81, -1, 6, RCX); // xor ecx, 0xFF
+			emit32(e, 0xFF);
+		}
+		reg_op(e, 0, 0x89, -1, REG_SR, RAX); // mov eax, sr
+		reg_op(e, 0, 0x83, -1, 4, RAX); // and eax, 1
+		emit8(e, 1);
+		reg_op(e, 0, 0x01, -1, REG_A, RAX); // add eax, a
+		reg_op(e, 0, 0x01, -1, RCX, RAX); // add eax, ecx
+		alu8_imm(e, 4, REG_SR, 0x3C); // and sr, ~(N|V|Z|C)
+		reg_op(e, 0, 0x31, -1, RAX, RCX); // xor ecx, eax
+		reg_op(e, 0, 0x31, -1, RAX, REG_A); // xor a, eax
+		reg_op(e, 0, 0x21, -1, REG_A, RCX); // and ecx, a
+		reg_op(e, 0, 0x81, -1, 4, RCX); // and ecx, 0x80
+		emit32(e, 0x80);
+		reg_op(e, 0, 0xD1, -1, 5, RCX); // shr ecx, 1
+		reg_op(e, 0, 0x09, -1, RCX, REG_SR); // or sr, ecx (V)
+		reg_op(e, 0, 0x89, -1, RAX, RCX); // mov ecx, eax
+		reg_op(e, 0, 0xC1, -1, 5, RCX); // shr ecx, 8
+		emit8(e, 8);
+		reg_op(e, 0, 0x09, -1, RCX, REG_SR); // or sr, ecx (C)
+		reg_op(e, 0, 0x0F, 0xB6, REG_A, RAX); // movzx a, al
+		set_nz(e, REG_A);
+	} else if (mode == REL) {
+		// B?? rel: find which flag it tests and which way
+		static const char conds[] = "PL\200\0MI\200\200VC\100\0VS\100\100CC\1\0CS\1\1NE\2\0EQ\2\2";
+		const char * c;
+		uint16_t target = next_pc + (int8_t)operand;
+
+		for (c = conds; *c; c += 4)
+			if (c[0] == name[1] && c[1] == name[2]) break;
+		if (*c == 0) return UNSUPPORTED;
+		taken = cycles + 1 + (((target ^ next_pc) & 0xff00) != 0);
+
+		reg_op(e, 0, 0xF6, -1, 0, REG_SR); // test sr, flag
+		emit8(e, c[2]);
+		skip = jcc8(e, c[3] ? CC_NZ : CC_Z);
+		emit_exit(e, next_pc, cycles, 0, 0);
+		patch8(e, skip);
+		emit_exit(e, target, taken, 0, 0);
+		return END;
+	} else if (!strcmp(name, "JMP abs")) {
+		emit_exit(e, operand, cycles, 0, 0);
+		return END;
+	} else {
+		return UNSUPPORTED;
+	}
+	return CONTINUE;
+}
+
+/* Block Management */
+
+static inline JitBlock * slot(struct Jit * jit, uint16_t start)
+{
+	return &jit->blocks[(start ^ (start >> 12)) & (JIT_TABLE_SIZE - 1)];
+}
+
+static inline void mark_code(struct Jit * jit, uint32_t start, uint32_t end)
+{
+	for (; start < end; start++)
+		jit->tables.code[start >> 3] |= 1 << (start & 7);
+}
+
+static void reset_buffer(struct Jit * jit)
+{
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	memset(jit->tables.code, 0, sizeof(jit->tables.code));
+	jit->used = 0;
+}
+
+static int can_compile(CPU * cpu, uint32_t pc)
+{
+	return pc + 3 <= 0x10000 && cpu->pages[pc >> 8].read != NULL;
+}
+
+static JitBlock * compile(CPU * cpu, uint16_t start)
+{
+	struct Jit * jit = cpu->jit;
+	JitBlock * b;
+	Emitter e;
+	Result r = UNSUPPORTED;
+	uint32_t pc = start;
+	int cycles = 0;
+	int n;
+
+	if (jit->used + JIT_BLOCK_MAX * INST_MAX + STUB_MAX > JIT_BUFFER_SIZE)
+		reset_buffer(jit);
+	e.p = jit->buffer + jit->used;
+
+	// movzx each guest register out of the CPU struct
+	mem_op(&e, 0, 0x0F, 0xB6, REG_A, REG_CPU, offsetof(CPU, A));
+	mem_op(&e, 0, 0x0F, 0xB6, REG_X, REG_CPU, offsetof(CPU, X));
+	mem_op(&e, 0, 0x0F, 0xB6, REG_Y, REG_CPU, offsetof(CPU, Y));
+	mem_op(&e, 0, 0x0F, 0xB6, REG_SR, REG_CPU, offsetof(CPU, SR));
+
+	for (n = 0; n < JIT_BLOCK_MAX && can_compile(cpu, pc); n++) {
+		r = emit_inst(cpu, &e, pc, cycles);
+		if (r == UNSUPPORTED) break;
+		cycles += instructions[cpu->memory[pc]].cycles;
+		pc += lengths[instructions[cpu->memory[pc]].mode];
+		if (r == END) break;
+	}
+	if (n == 0) return NULL;
+	if (r != END) emit_exit(&e, pc, cycles, 0, 0);
+
+	b = slot(jit, start);
+	b->code = jit->buffer + jit->used;
+	b->start = start;
+	b->end = pc;
+	jit->used = e.p - jit->buffer;
+	mark_code(jit, start, pc);
+	watch_code(cpu, start, pc);
+	return b;
+}
+
+int run_jit(CPU * cpu) // returns cycles run, or 0 if the interpreter should take this one
+{
+	struct Jit * jit = cpu->jit;
+	uint16_t pc = cpu->PC;
+	JitBlock * b = slot(jit, pc);
+	int (*block)(CPU * cpu, uint8_t * memory, JitTables * tables);
+	int cycles;
+
+	if (b->code == NULL || b->start != pc) {
+		if (jit->hits[pc] == JIT_NEVER) return 0;
+		if (jit->hits[pc] < JIT_THRESHOLD) {
+			jit->hits[pc]++;
+			return 0;
+		}
+		b = compile(cpu, pc);
+		if (b == NULL) {
+			jit->hits[pc] = JIT_NEVER;
+			return 0;
+		}
+	}
+
+	jit->tables.written = -1;
+	block = __extension__ (int (*)(CPU *, uint8_t *, JitTables *))b->code;
+	cpu->SR.byte = get_sr(cpu); // compiled code keeps the flags packed
+	cycles = block(cpu, cpu->memory, &jit->tables);
+	set_sr(cpu, cpu->SR.byte);
+	if (jit->tables.written >= 0) jit_check_write(cpu, jit->tables.written);
+	return cycles;
+}
+
+void jit_check_write(CPU * cpu, uint16_t addr) // drops compiled code that a write landed in
+{
+	struct Jit * jit = cpu->jit;
+	JitBlock * b;
+	int start;
+	uint32_t lo, hi;
+
+	if (!(jit->tables.code[addr >> 3] & (1 << (addr & 7)))) return;
+
+	lo = addr;
+	hi = addr + 1;
+	for (start = addr; start >= 0 && start > (int)addr - JIT_BLOCK_SPAN; start--) {
+		b = slot(jit, start);
+		if (b->code && b->start == start && addr < b->end) {
+			// self-modifying code stays interpreted from now on
+			b->code = NULL;
+			jit->hits[start] = JIT_NEVER;
+			if (b->start < lo) lo = b->start;
+			if (b->end > hi) hi = b->end;
+		}
+	}
+
+	// clear the dropped range, then put back anything still compiled there
+	for (start = lo; start < hi; start++)
+		jit->tables.code[start >> 3] &= ~(1 << (start & 7));
+	for (start = lo - JIT_BLOCK_SPAN; start < (int)hi; start++) {
+		if (start < 0) continue;
+		b = slot(jit, start);
+		if (b->code && b->start == start) mark_code(jit, b->start, b->end);
+	}
+}
+
+/* Setup */
+
+int init_jit(CPU * cpu)
+{
+	struct Jit * jit = calloc(1, sizeof(struct Jit));
+	int i;
+
+	if (jit == NULL) return -1;
+	jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->buffer == MAP_FAILED) {
+		free(jit);
+		return -1;
+	}
+	for (i = 0; i < 0x100; i++)
+		jit->tables.nz[i] = (i & 0x80) | (i == 0 ? 0x02 : 0);
+	cpu->jit = jit;
+	return 0;
+}
+
+void free_jit(CPU * cpu)
+{
+	if (cpu->jit == NULL) return;
+	munmap(cpu->jit->buffer, JIT_BUFFER_SIZE);
+	free(cpu->jit);
+	cpu->jit = NULL;
+}
+
+void flush_jit(CPU * cpu) // call after changing memory behind the CPU's back
+{
+	reset_buffer(cpu->jit);
+	memset(cpu->jit->hits, 0, sizeof(cpu->jit->hits));
+}
+
+#else
+
+int init_jit(CPU * cpu)
+{
+	return -1; // only x86-64 hosts are supported
+}
+
+void free_jit(CPU * cpu)
+{
+}
+
+void flush_jit(CPU * cpu)
+{
+}
+
+int run_jit(CPU * cpu)
+{
+	return 0;
+}
+
+void jit_check_write(CPU * cpu, uint16_t addr)
+{
+}
+
+#endif
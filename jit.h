@@ -0,0 +1,37 @@
+#define JIT_BUFFER_SIZE (1 << 20) // bytes of host code
+#define JIT_TABLE_SIZE 4096 // compiled blocks, must be a power of two
+#define JIT_BLOCK_MAX 32 // instructions per block
+#define JIT_BLOCK_SPAN (JIT_BLOCK_MAX * 3) // most bytes a block can cover
+#define JIT_THRESHOLD 16 // visits before a block is compiled
+#define JIT_NEVER 0xFF // hit count for blocks that can't be compiled
+
+// the first argument of every compiled block
+typedef struct {
+	uint8_t nz[0x100]; // N and Z bits for each result byte; must come first
+	uint8_t code[0x10000 / 8]; // one bit per guest byte covered by a compiled block
+	int32_t written; // address of a store that hit compiled code, or -1
+} JitTables;
+
+typedef struct {
+	uint8_t * code; // NULL when the slot is empty
+	uint16_t start;
+	uint32_t end; // one past the last byte of guest code
+} JitBlock;
+
+struct Jit {
+	JitTables tables;
+	JitBlock blocks[JIT_TABLE_SIZE]; // direct mapped, keyed by start address
+	uint8_t hits[0x10000]; // visits to each address while interpreting
+	uint8_t * buffer;
+	size_t used;
+};
+
+int init_jit(CPU * cpu);
+
+void free_jit(CPU * cpu);
+
+void flush_jit(CPU * cpu);
+
+int run_jit(CPU * cpu);
+
+void jit_check_write(CPU * cpu, uint16_t addr);
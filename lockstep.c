@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "lockstep.h"
+
+// Runs up to LOCKSTEP_LANES machines that are executing the same code. While
+// their PCs agree, the registers of every machine sit side by side in vectors
+// (GCC vector extensions) and each instruction is decoded once and carried
+// out for all of them together. Memory is still each machine's own, so loads
+// and stores go lane by lane, and instructions that touch a page that isn't
+// plain RAM, or that need the interrupt logic, are stepped one machine at a
+// time with step_cpu. When the machines stop agreeing on where to go next
+// (a branch taken by some, an RTS to different places, differing code) the
+// ones outside the biggest group write their registers back and finish on
+// their own with run_cycles, so every machine ends exactly where it would
+// have run alone.
+//
+// The loop is built for AVX2 and for plain x86-64, and the loader picks one
+// for the host it runs on.
+
+typedef uint8_t Lanes8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t Lanes16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef uint64_t Lanes64 __attribute__((vector_size(LOCKSTEP_LANES * 8)));
+typedef uint32_t LaneMask; // one bit per lane
+
+#ifdef __x86_64__
+#define LANE_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_TARGETS
+#endif
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+enum { // one per handler in opcodes.h
+	OP_ADC, OP_AND, OP_ASL, OP_BCC, OP_BCS, OP_BEQ, OP_BIT, OP_BMI, OP_BNE, OP_BPL, OP_BRK, OP_BVC, OP_BVS,
+	OP_CLC, OP_CLD, OP_CLI, OP_CLV, OP_CMP, OP_CPX, OP_CPY, OP_DEC, OP_DEX, OP_DEY, OP_EOR, OP_INC, OP_INX,
+	OP_INY, OP_JMP, OP_JSR, OP_LDA, OP_LDX, OP_LDY, OP_LSR, OP_NOP, OP_ORA, OP_PHA, OP_PHP, OP_PLA, OP_PLP,
+	OP_ROL, OP_ROR, OP_RTI, OP_RTS, OP_SBC, OP_SEC, OP_SED, OP_SEI, OP_STA, OP_STX, OP_STY, OP_TAX, OP_TAY,
+	OP_TSX, OP_TXA, OP_TXS, OP_TYA,
+};
+
+static const uint8_t ops[0x100] = {
+#define OPCODE(op, mnemonic, name, mode, cycles) [op] = OP_##name,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+typedef struct {
+	// the machines in lockstep; lanes outside active hold stale values
+	Lanes8 a, x, y, sp;
+	Lanes8 sr; // I, D, B and the unused bit, as in CPU
+	Lanes8 carry, v;
+	Lanes16 nz;
+	Lanes64 cycles;
+	Lanes64 stop; // min(deadline, end), as run_cycles works it out
+	Lanes64 end;
+	uint16_t pc;
+	uint32_t stuck_steps;
+	uint64_t steps; // instructions run so far
+
+	int lanes; // lanes in use; the lanes past them only pad out the vectors
+	LaneMask active; // lanes still running together
+	LaneMask alone; // lanes that left to finish with run_cycles
+	LaneMask stepped; // ...straight after an instruction, so the checks run_loop makes after a step are still due
+	uint8_t * memory[LOCKSTEP_LANES];
+	CPU * cpu[LOCKSTEP_LANES];
+	uint8_t special[0x100 / 8]; // pages that aren't plain RAM in at least one lane
+
+	int flags; // RUN_BREAK and RUN_STUCK
+	uint16_t break_pc;
+	uint32_t stuck_limit;
+	int * why;
+	uint64_t * lane_steps;
+} Group;
+
+/* Lane Helpers */
+
+ALWAYS_INLINE Lanes16 wide(Lanes8 v)
+{
+	return __builtin_convertvector(v, Lanes16);
+}
+
+ALWAYS_INLINE Lanes8 narrow(Lanes16 v)
+{
+	return __builtin_convertvector(v, Lanes8);
+}
+
+ALWAYS_INLINE LaneMask mask8(Group * g, Lanes8 cond) // cond is a comparison result, 0 or all ones per lane
+{
+	LaneMask m = 0;
+	int l;
+
+	for (l = 0; l < g->lanes; l++) m |= (LaneMask)(cond[l] & 1) << l;
+	return m & g->active;
+}
+
+ALWAYS_INLINE LaneMask mask16(Group * g, Lanes16 cond)
+{
+	return mask8(g, narrow(cond));
+}
+
+
+ALWAYS_INLINE LaneMask due_lanes(Group * g) // lanes that have reached their stop
+{
+	LaneMask m = 0;
+	int l;
+
+	for (l = 0; l < g->lanes; l++) m |= (LaneMask)(g->cycles[l] >= g->stop[l]) << l;
+	return m & g->active;
+}
+
+ALWAYS_INLINE Lanes16 select16(LaneMask m, Lanes16 yes, Lanes16 no)
+{
+	Lanes16 r;
+	int l;
+
+	for (l = 0; l < LOCKSTEP_LANES; l++) r[l] = (m >> l) & 1 ? yes[l] : no[l];
+	return r;
+}
+
+ALWAYS_INLINE Lanes8 gather(Group * g, Lanes16 addr)
+{
+	Lanes8 r = {0};
+	int l;
+
+	for (l = 0; l < g->lanes; l++) r[l] = g->memory[l][addr[l]];
+	return r;
+}
+
+ALWAYS_INLINE void scatter(Group * g, Lanes16 addr, Lanes8 val)
+{
+	LaneMask m;
+	int l;
+
+	for (m = g->active; m; m &= m - 1) {
+		l = __builtin_ctz(m);
+		g->memory[l][addr[l]] = val[l];
+	}
+}
+
+ALWAYS_INLINE bool is_special(Group * g, uint16_t addr)
+{
+	return (g->special[addr >> 11] >> ((addr >> 8) & 7)) & 1;
+}
+
+ALWAYS_INLINE bool any_special(Group * g, Lanes16 addr)
+{
+	LaneMask m;
+
+	for (m = g->active; m; m &= m - 1)
+		if (is_special(g, addr[__builtin_ctz(m)])) return true;
+	return false;
+}
+
+ALWAYS_INLINE Lanes8 pull(Group * g)
+{
+	g->sp += 1;
+	return gather(g, wide(g->sp) + 0x100);
+}
+
+ALWAYS_INLINE void push(Group * g, Lanes8 val)
+{
+	scatter(g, wide(g->sp) + 0x100, val);
+	g->sp -= 1;
+}
+
+ALWAYS_INLINE Lanes8 get_srs(Group * g) // get_sr for every lane
+{
+	return (g->sr & 0x3C) | g->carry | (narrow((g->nz & 0xFF) == 0) & 0x02)
+		| ((g->v & 0x80) >> 1) | (narrow((g->nz & 0x180) != 0) & 0x80);
+}
+
+/* Machines */
+
+static void sync_in(Group * g, int l) // registers from the lane's CPU
+{
+	CPU * cpu = g->cpu[l];
+
+	g->a[l] = cpu->A;
+	g->x[l] = cpu->X;
+	g->y[l] = cpu->Y;
+	g->sp[l] = cpu->SP;
+	g->sr[l] = cpu->SR.byte;
+	g->carry[l] = cpu->carry;
+	g->v[l] = cpu->v;
+	g->nz[l] = cpu->nz;
+	g->cycles[l] = cpu->total_cycles;
+	g->stop[l] = cpu->deadline < g->end[l] ? cpu->deadline : g->end[l];
+}
+
+static void sync_out(Group * g, int l, uint16_t pc) // registers back to the lane's CPU
+{
+	CPU * cpu = g->cpu[l];
+
+	cpu->A = g->a[l];
+	cpu->X = g->x[l];
+	cpu->Y = g->y[l];
+	cpu->SP = g->sp[l];
+	cpu->SR.byte = g->sr[l];
+	cpu->carry = g->carry[l];
+	cpu->v = g->v[l];
+	cpu->nz = g->nz[l];
+	cpu->total_cycles = g->cycles[l];
+	cpu->PC = pc;
+	cpu->stuck_steps = g->stuck_steps;
+}
+
+static void finish(Group * g, LaneMask lanes, int why) // lanes stop where they are
+{
+	int l;
+
+	for (l = 0; l < LOCKSTEP_LANES; l++) {
+		if (!((lanes >> l) & 1)) continue;
+		sync_out(g, l, g->pc);
+		g->why[l] = why;
+		g->lane_steps[l] = g->steps;
+	}
+	g->active &= ~lanes;
+}
+
+static void leave(Group * g, LaneMask lanes, Lanes16 pcs, bool stepped) // lanes go on alone from pcs; call before g->pc moves
+{
+	int l;
+
+	for (l = 0; l < LOCKSTEP_LANES; l++) {
+		if (!((lanes >> l) & 1)) continue;
+		sync_out(g, l, pcs[l]);
+		if (stepped && (g->flags & RUN_STUCK))
+			g->cpu[l]->stuck_steps = pcs[l] == g->pc ? g->stuck_steps + 1 : 0;
+		g->lane_steps[l] = g->steps + stepped;
+	}
+	g->active &= ~lanes;
+	g->alone |= lanes;
+	if (stepped) g->stepped |= lanes;
+}
+
+static void fire_events(Group * g, LaneMask due) // what run_cycles does once the run loop reaches cpu->stop
+{
+	CPU * cpu;
+	int l;
+
+	for (l = 0; l < LOCKSTEP_LANES; l++) {
+		if (!((due >> l) & 1)) continue;
+		if (g->cycles[l] >= g->end[l]) {
+			finish(g, 1u << l, 0);
+			continue;
+		}
+		cpu = g->cpu[l];
+		sync_out(g, l, g->pc);
+		run_events(cpu);
+		if (cpu->interrupts) { // taking interrupts is left to run_cycles
+			g->lane_steps[l] = g->steps;
+			g->active &= ~(1u << l);
+			g->alone |= 1u << l;
+		} else {
+			sync_in(g, l);
+		}
+	}
+}
+
+static void step_alone(Group * g) // steps each lane through the ordinary interpreter, then regroups
+{
+	Lanes16 pcs = {0};
+	CPU * cpu;
+	LaneMask apart = 0;
+	int l, leader = __builtin_ctz(g->active);
+
+	for (l = 0; l < LOCKSTEP_LANES; l++) {
+		if (!((g->active >> l) & 1)) continue;
+		cpu = g->cpu[l];
+		sync_out(g, l, g->pc);
+		cpu->stop = g->stop[l];
+		step_cpu(cpu, 0);
+		sync_in(g, l);
+		pcs[l] = cpu->PC;
+	}
+	for (l = 0; l < LOCKSTEP_LANES; l++)
+		if (((g->active >> l) & 1) && (pcs[l] != pcs[leader] || g->cpu[l]->interrupts)) apart |= 1u << l;
+	if (apart) leave(g, apart, pcs, true);
+	g->pc = pcs[leader];
+}
+
+/* Lockstep Interpreter */
+
+ALWAYS_INLINE Lanes16 address(Group * g, Mode mode, uint8_t b1, uint16_t w, Lanes16 * extra)
+{
+	Lanes16 p = {0}, base;
+	int l;
+
+	switch (mode) {
+	case IMM:
+		return p + (uint16_t)(g->pc + 1);
+	case ZP:
+		return p + b1;
+	case ZPX:
+		return (wide(g->x) + b1) & 0xFF;
+	case ZPY:
+		return (wide(g->y) + b1) & 0xFF;
+	case ABS:
+		return p + w;
+	case ABSX:
+		p = wide(g->x) + w;
+		*extra += (Lanes16)((p & 0xFF) < wide(g->x)) & 1;
+		return p;
+	case ABSY:
+		p = wide(g->y) + w;
+		*extra += (Lanes16)((p & 0xFF) < wide(g->y)) & 1;
+		return p;
+	case XIND:
+		base = (wide(g->x) + b1) & 0xFF;
+		for (l = 0; l < g->lanes; l++)
+			p[l] = g->memory[l][base[l]] | g->memory[l][(base[l] + 1) & 0xFF] << 8;
+		return p;
+	case INDY:
+		for (l = 0; l < g->lanes; l++)
+			p[l] = g->memory[l][b1] | g->memory[l][(b1 + 1) & 0xFF] << 8;
+		p += wide(g->y);
+		*extra += (Lanes16)((p & 0xFF) < wide(g->y)) & 1;
+		return p;
+	case JMP_IND_BUG:
+		for (l = 0; l < g->lanes; l++)
+			p[l] = g->memory[l][w] | g->memory[l][(w & 0xFF00) | ((w + 1) & 0xFF)] << 8;
+		return p;
+	default: // IMPL, ACC and REL
+		return p;
+	}
+}
+
+ALWAYS_INLINE void branch(Group * g, Lanes16 cond, int8_t offset, int cycles, Lanes16 * extra)
+{
+	uint16_t next = g->pc + 2, target = g->pc + offset + 2;
+	LaneMask taken = mask16(g, cond), stay;
+	Lanes16 pcs;
+
+	// the page test is the one take_branch makes, before the PC moves past the branch
+	*extra += cond & (uint16_t)(1 + (((uint16_t)(g->pc + offset) ^ next) & 0xFF00 ? 1 : 0));
+	if (taken == 0 || taken == g->active) {
+		g->pc = taken ? target : next;
+		return;
+	}
+	// the larger side stays in lockstep
+	stay = __builtin_popcount(taken) * 2 >= __builtin_popcount(g->active) ? taken : g->active & ~taken;
+	pcs = select16(taken, (Lanes16){0} + target, (Lanes16){0} + next);
+	g->cycles += __builtin_convertvector(*extra, Lanes64) + cycles; // leave takes the finished instruction with it
+	leave(g, g->active & ~stay, pcs, true);
+	g->cycles -= __builtin_convertvector(*extra, Lanes64) + cycles;
+	g->pc = stay == taken ? target : next;
+}
+
+ALWAYS_INLINE void step_lanes(Group * g)
+{
+	int leader = __builtin_ctz(g->active), l;
+	uint8_t * code = g->memory[leader];
+	uint16_t pc = g->pc;
+	uint8_t op = code[pc], b1 = code[(uint16_t)(pc + 1)], b2 = code[(uint16_t)(pc + 2)];
+	uint16_t w = b1 | b2 << 8;
+	Instruction * inst = &instructions[op];
+	int length = lengths[inst->mode], name = ops[op];
+	Lanes16 extra = {0}, addr, pcs;
+	Lanes8 val;
+	LaneMask differ = 0, m;
+	bool data;
+
+	for (m = g->active; m; m &= m - 1) { // lanes running different code go their own way
+		l = __builtin_ctz(m);
+		if (g->memory[l][pc] != op || (length > 1 && g->memory[l][(uint16_t)(pc + 1)] != b1)
+				|| (length > 2 && g->memory[l][(uint16_t)(pc + 2)] != b2))
+			differ |= 1u << l;
+	}
+	if (differ) {
+		leave(g, differ, (Lanes16){0} + pc, false);
+		if (g->active == 0) return;
+	}
+
+	// pages that aren't plain RAM, interrupts and decimal mode go through step_cpu
+	if (is_special(g, pc) || is_special(g, pc + length - 1) || name == OP_BRK || name == OP_RTI || name == OP_CLI
+			|| ((name == OP_ADC || name == OP_SBC) && (mask8(g, (Lanes8)((g->sr & 0x08) != 0))))
+			|| (inst->mode == JMP_IND_BUG && (is_special(g, w) || is_special(g, (w & 0xFF00) | ((w + 1) & 0xFF))))) {
+		step_alone(g);
+		return;
+	}
+	addr = address(g, inst->mode, b1, w, &extra);
+	data = inst->mode != IMPL && inst->mode != ACC && inst->mode != REL && inst->mode != IMM
+		&& name != OP_JMP && name != OP_JSR && name != OP_NOP;
+	if (data && any_special(g, addr)) {
+		step_alone(g);
+		return;
+	}
+
+	switch (name) {
+	case OP_ADC:
+		val = gather(g, addr);
+		{
+			Lanes16 tmp = wide(g->a) + wide(val) + wide(g->carry);
+			g->carry = narrow((Lanes16)(tmp > 0xFF)) & 1;
+			g->v = (g->a ^ narrow(tmp)) & (val ^ narrow(tmp));
+			g->a = narrow(tmp);
+		}
+		g->nz = wide(g->a);
+		break;
+	case OP_SBC:
+		val = gather(g, addr);
+		{
+			Lanes16 tmp = wide(g->a) - wide(val) - 1 + wide(g->carry);
+			g->v = (g->a ^ narrow(tmp)) & (g->a ^ val);
+			g->a = narrow(tmp);
+			g->carry = narrow((Lanes16)(tmp < 0x100)) & 1;
+		}
+		g->nz = wide(g->a);
+		break;
+	case OP_AND:
+		g->a &= gather(g, addr);
+		g->nz = wide(g->a);
+		break;
+	case OP_ORA:
+		g->a |= gather(g, addr);
+		g->nz = wide(g->a);
+		break;
+	case OP_EOR:
+		g->a ^= gather(g, addr);
+		g->nz = wide(g->a);
+		break;
+	case OP_BIT:
+		val = gather(g, addr);
+		g->nz = wide(val & g->a) | (wide(val & 0x80) << 1);
+		g->v = val << 1;
+		break;
+	case OP_CMP:
+	case OP_CPX:
+	case OP_CPY:
+		val = gather(g, addr);
+		{
+			Lanes8 reg = name == OP_CMP ? g->a : name == OP_CPX ? g->x : g->y;
+			g->nz = wide((Lanes8)(reg - val));
+			g->carry = (Lanes8)(reg >= val) & 1;
+		}
+		break;
+	case OP_ASL:
+	case OP_LSR:
+	case OP_ROL:
+	case OP_ROR:
+		val = inst->mode == ACC ? g->a : gather(g, addr);
+		{
+			Lanes16 tmp = wide(val);
+			if (name == OP_ASL) {
+				g->carry = val >> 7;
+				tmp = (tmp << 1) & 0xFF;
+			} else if (name == OP_LSR) {
+				g->carry = val & 1;
+				tmp >>= 1;
+			} else if (name == OP_ROL) {
+				tmp = (tmp << 1) | wide(g->carry);
+				g->carry = val >> 7;
+				tmp &= 0xFF;
+			} else {
+				tmp |= wide(g->carry) << 8;
+				g->carry = val & 1;
+				tmp >>= 1;
+			}
+			g->nz = tmp;
+			val = narrow(tmp);
+		}
+		if (inst->mode == ACC) g->a = val;
+		else scatter(g, addr, val);
+		break;
+	case OP_INC:
+	case OP_DEC:
+		val = gather(g, addr) + (uint8_t)(name == OP_INC ? 1 : 0xFF);
+		g->nz = wide(val);
+		scatter(g, addr, val);
+		break;
+	case OP_INX: g->x += 1; g->nz = wide(g->x); break;
+	case OP_INY: g->y += 1; g->nz = wide(g->y); break;
+	case OP_DEX: g->x -= 1; g->nz = wide(g->x); break;
+	case OP_DEY: g->y -= 1; g->nz = wide(g->y); break;
+	case OP_LDA: g->a = gather(g, addr); g->nz = wide(g->a); break;
+	case OP_LDX: g->x = gather(g, addr); g->nz = wide(g->x); break;
+	case OP_LDY: g->y = gather(g, addr); g->nz = wide(g->y); break;
+	case OP_STA: scatter(g, addr, g->a); extra = (Lanes16){0}; break;
+	case OP_STX: scatter(g, addr, g->x); break;
+	case OP_STY: scatter(g, addr, g->y); break;
+	case OP_TAX: g->x = g->a; g->nz = wide(g->x); break;
+	case OP_TAY: g->y = g->a; g->nz = wide(g->y); break;
+	case OP_TSX: g->x = g->sp; g->nz = wide(g->x); break;
+	case OP_TXA: g->a = g->x; g->nz = wide(g->a); break;
+	case OP_TYA: g->a = g->y; g->nz = wide(g->a); break;
+	case OP_TXS: g->sp = g->x; break;
+	case OP_CLC: g->carry = (Lanes8){0}; break;
+	case OP_SEC: g->carry = (Lanes8){0} + 1; break;
+	case OP_CLV: g->v = (Lanes8){0}; break;
+	case OP_CLD: g->sr &= ~0x08; break;
+	case OP_SED: g->sr |= 0x08; break;
+	case OP_SEI: g->sr |= 0x04; break;
+	case OP_PHA: push(g, g->a); break;
+	case OP_PHP: push(g, get_srs(g) | 0x10); break;
+	case OP_PLA: g->a = pull(g); g->nz = wide(g->a); break;
+	case OP_PLP:
+		val = pull(g);
+		g->sr = (val | 0x20) & ~0x10;
+		g->carry = val & 1;
+		g->v = val << 1;
+		g->nz = (wide(val & 0x80) << 1) | ((Lanes16)(wide(val & 0x02) == 0) & 1);
+		break;
+	case OP_NOP:
+		break;
+	case OP_JSR:
+		push(g, (Lanes8){0} + (uint8_t)((pc + 2) >> 8));
+		push(g, (Lanes8){0} + (uint8_t)(pc + 2));
+		g->pc = w;
+		length = 0;
+		break;
+	case OP_JMP:
+		pcs = addr;
+		if (inst->mode == ABS) pcs = (Lanes16){0} + w;
+		goto jump;
+	case OP_RTS:
+		val = pull(g);
+		pcs = wide(val) | (wide(pull(g)) << 8);
+		pcs += 1;
+	jump:
+		length = 0;
+		differ = mask16(g, (Lanes16)(pcs != pcs[leader]));
+		if (differ) {
+			g->cycles += inst->cycles; // leave takes the finished instruction with it
+			leave(g, differ, pcs, true);
+			g->cycles -= inst->cycles;
+		}
+		g->pc = pcs[leader];
+		break;
+	case OP_BCC: branch(g, (Lanes16)(wide(g->carry) == 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BCS: branch(g, (Lanes16)(wide(g->carry) != 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BEQ: branch(g, (Lanes16)((g->nz & 0xFF) == 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BNE: branch(g, (Lanes16)((g->nz & 0xFF) != 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BMI: branch(g, (Lanes16)((g->nz & 0x180) != 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BPL: branch(g, (Lanes16)((g->nz & 0x180) == 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BVC: branch(g, (Lanes16)(wide(g->v & 0x80) == 0), b1, inst->cycles, &extra); length = 0; break;
+	case OP_BVS: branch(g, (Lanes16)(wide(g->v & 0x80) != 0), b1, inst->cycles, &extra); length = 0; break;
+	}
+
+	// 7 cycle instructions (e.g. ROL $nnnn,X) don't have a penalty cycle for
+	// crossing a page boundary.
+	if (inst->cycles == 7) extra = (Lanes16){0};
+	g->cycles += __builtin_convertvector(extra, Lanes64) + inst->cycles;
+	g->pc += length;
+}
+
+LANE_TARGETS static void run_group(Group * g) // until every lane has finished or left
+{
+	uint16_t pc;
+
+	while (g->active) {
+		LaneMask due = due_lanes(g);
+
+		if (due) {
+			fire_events(g, due);
+			if (g->active == 0) break;
+		}
+		pc = g->pc;
+		step_lanes(g);
+		g->steps++;
+		if (g->active == 0) break;
+		if ((g->flags & RUN_BREAK) && g->pc == g->break_pc) {
+			finish(g, g->active, RUN_BREAK);
+		} else if (g->flags & RUN_STUCK) {
+			if (g->pc != pc) g->stuck_steps = 0;
+			else if (++g->stuck_steps >= g->stuck_limit) finish(g, g->active, RUN_STUCK);
+		}
+	}
+}
+
+/* Entry Point */
+
+static bool plain_ram(CPU * cpu, int page)
+{
+	return cpu->pages[page].read == &cpu->memory[page << 8] && cpu->pages[page].write == &cpu->memory[page << 8];
+}
+
+static bool can_group(CPU ** cpus, int num_lanes)
+{
+	int i;
+
+	for (i = 0; i < num_lanes; i++) {
+		if (cpus[i]->run_flags & ~(RUN_BREAK | RUN_STUCK) || cpus[i]->run_flags != cpus[0]->run_flags
+				|| cpus[i]->break_pc != cpus[0]->break_pc || cpus[i]->stuck_limit != cpus[0]->stuck_limit
+				|| cpus[i]->PC != cpus[0]->PC || cpus[i]->stuck_steps != cpus[0]->stuck_steps
+				|| cpus[i]->cache || cpus[i]->jit || cpus[i]->idle || cpus[i]->hle || cpus[i]->interrupts
+				|| !plain_ram(cpus[i], 0x00) || !plain_ram(cpus[i], 0x01)) // pointers and the stack are read directly
+			return false;
+	}
+	return num_lanes > 1 && num_lanes <= LOCKSTEP_LANES;
+}
+
+// Runs each machine as run_cycles(cpus[i], budget) would, filling in why[i]
+// with what it returned and steps[i] with how many instructions it ran
+// alongside the others. Machines that can't be grouped just run one by one.
+void run_lockstep(CPU ** cpus, int num_lanes, uint64_t budget, int * why, uint64_t * steps)
+{
+	Group * g;
+	CPU * cpu;
+	uint64_t end;
+	int l, page;
+
+	// the vectors are aligned to their size, which is more than malloc promises
+	if (!can_group(cpus, num_lanes) || posix_memalign((void **)&g, __alignof__(Group), sizeof(Group)) != 0) {
+		for (l = 0; l < num_lanes; l++) {
+			why[l] = run_cycles(cpus[l], budget);
+			steps[l] = 0;
+		}
+		return;
+	}
+	memset(g, 0, sizeof(Group));
+	g->pc = cpus[0]->PC;
+	g->flags = cpus[0]->run_flags;
+	g->break_pc = cpus[0]->break_pc;
+	g->stuck_limit = cpus[0]->stuck_limit;
+	g->stuck_steps = cpus[0]->stuck_steps;
+	g->lanes = num_lanes;
+	g->why = why;
+	g->lane_steps = steps;
+	for (l = 0; l < num_lanes; l++) {
+		g->memory[l] = cpus[l]->memory;
+		g->cpu[l] = cpus[l];
+		end = cpus[l]->total_cycles + budget;
+		g->end[l] = end < budget ? UINT64_MAX : end;
+		sync_in(g, l);
+		g->active |= 1u << l;
+		for (page = 0; page < 0x100; page++)
+			if (!plain_ram(cpus[l], page)) g->special[page >> 3] |= 1 << (page & 7);
+	}
+
+	run_group(g);
+
+	for (l = 0; l < num_lanes; l++) { // the ones that left finish on their own
+		if (!((g->alone >> l) & 1)) continue;
+		cpu = cpus[l];
+		if ((g->stepped >> l) & 1) {
+			if ((g->flags & RUN_BREAK) && cpu->PC == g->break_pc) {
+				why[l] = RUN_BREAK;
+				continue;
+			}
+			if ((g->flags & RUN_STUCK) && cpu->stuck_steps >= g->stuck_limit) {
+				why[l] = RUN_STUCK;
+				continue;
+			}
+		}
+		why[l] = cpu->total_cycles >= g->end[l] ? 0 : run_cycles(cpu, g->end[l] - cpu->total_cycles);
+	}
+	free(g);
+}
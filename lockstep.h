@@ -0,0 +1,4 @@
+#define LOCKSTEP_LANES 32 // machines per group: one AVX2 register of 8 bit lanes, at most 32
+#define LOCKSTEP_MIN_LANES 16 // smaller groups run slower than one by one (break-even is about 8 on the functional test)
+
+void run_lockstep(CPU ** cpus, int num_lanes, uint64_t budget, int * why, uint64_t * steps);
@@ -0,0 +1,61 @@
+#!/usr/bin/env python
+
+# Rebuilds the 64KB memory image from a stream written with -M, as it was
+# just before step STEP ran (step 0 is the first instruction, the same
+# numbering as the records written by -t).
+#
+# usage: memrebuild.py STREAM STEP [OUTPUT]
+
+import struct
+import sys
+
+MAGIC = b'6502MEM1'
+RECORD = struct.Struct('<QQH') # step, cycles, num_pages; see dump.h
+PAGE = 1 + 0x100
+
+
+def find_start(f, step):
+    # offset of the last keyframe at or before step; only headers are read
+    start = None
+    while True:
+        pos = f.tell()
+        header = f.read(RECORD.size)
+        if len(header) < RECORD.size:
+            return start
+        when, cycles, num_pages = RECORD.unpack(header)
+        if when > step:
+            return start
+        if num_pages == 0x100:
+            start = pos
+        f.seek(num_pages * PAGE, 1)
+
+
+def main():
+    step = int(sys.argv[2], 0)
+    out = sys.argv[3] if len(sys.argv) > 3 else 'memdump'
+    memory = bytearray(0x10000)
+
+    with open(sys.argv[1], 'rb') as f:
+        if f.read(len(MAGIC)) != MAGIC:
+            sys.exit('%s is not a memory stream' % sys.argv[1])
+        start = find_start(f, step)
+        if start is None:
+            sys.exit('no keyframe at or before step %d' % step)
+        f.seek(start)
+        while True:
+            header = f.read(RECORD.size)
+            if len(header) < RECORD.size:
+                break
+            when, cycles, num_pages = RECORD.unpack(header)
+            if when > step:
+                break
+            data = f.read(num_pages * PAGE)
+            for i in range(0, len(data), PAGE):
+                memory[data[i] << 8:(data[i] + 1) << 8] = data[i + 1:i + PAGE]
+
+    with open(out, 'wb') as f:
+        f.write(memory)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,259 @@
+/* Opcode table: OPCODE(opcode, mnemonic, handler, addressing mode, cycles)
+ * Define OPCODE before including this file. */
+
+OPCODE(0x00, "BRK impl", BRK, IMPL, 7)
+OPCODE(0x01, "ORA X,ind", ORA, XIND, 6)
+OPCODE(0x02, "???", NOP, IMPL, 2)
+OPCODE(0x03, "???", NOP, IMPL, 8)
+OPCODE(0x04, "???", NOP, ZP, 3)
+OPCODE(0x05, "ORA zpg", ORA, ZP, 3)
+OPCODE(0x06, "ASL zpg", ASL, ZP, 5)
+OPCODE(0x07, "???", NOP, IMPL, 5)
+OPCODE(0x08, "PHP impl", PHP, IMPL, 3)
+OPCODE(0x09, "ORA #", ORA, IMM, 2)
+OPCODE(0x0A, "ASL A", ASL, ACC, 2)
+OPCODE(0x0B, "???", NOP, IMPL, 2)
+OPCODE(0x0C, "???", NOP, ABS, 4)
+OPCODE(0x0D, "ORA abs", ORA, ABS, 4)
+OPCODE(0x0E, "ASL abs", ASL, ABS, 6)
+OPCODE(0x0F, "???", NOP, IMPL, 6)
+OPCODE(0x10, "BPL rel", BPL, REL, 2)
+OPCODE(0x11, "ORA ind,Y", ORA, INDY, 5)
+OPCODE(0x12, "???", NOP, IMPL, 2)
+OPCODE(0x13, "???", NOP, IMPL, 8)
+OPCODE(0x14, "???", NOP, ZP, 4)
+OPCODE(0x15, "ORA zpg,X", ORA, ZPX, 4)
+OPCODE(0x16, "ASL zpg,X", ASL, ZPX, 6)
+OPCODE(0x17, "???", NOP, IMPL, 6)
+OPCODE(0x18, "CLC impl", CLC, IMPL, 2)
+OPCODE(0x19, "ORA abs,Y", ORA, ABSY, 4)
+OPCODE(0x1A, "???", NOP, IMPL, 2)
+OPCODE(0x1B, "???", NOP, IMPL, 7)
+OPCODE(0x1C, "???", NOP, ABSX, 4)
+OPCODE(0x1D, "ORA abs,X", ORA, ABSX, 4)
+OPCODE(0x1E, "ASL abs,X", ASL, ABSX, 7)
+OPCODE(0x1F, "???", NOP, IMPL, 7)
+OPCODE(0x20, "JSR abs", JSR, ABS, 6)
+OPCODE(0x21, "AND X,ind", AND, XIND, 6)
+OPCODE(0x22, "???", NOP, IMPL, 2)
+OPCODE(0x23, "???", NOP, IMPL, 8)
+OPCODE(0x24, "BIT zpg", BIT, ZP, 3)
+OPCODE(0x25, "AND zpg", AND, ZP, 3)
+OPCODE(0x26, "ROL zpg", ROL, ZP, 5)
+OPCODE(0x27, "???", NOP, IMPL, 5)
+OPCODE(0x28, "PLP impl", PLP, IMPL, 4)
+OPCODE(0x29, "AND #", AND, IMM, 2)
+OPCODE(0x2A, "ROL A", ROL, ACC, 2)
+OPCODE(0x2B, "???", NOP, IMPL, 2)
+OPCODE(0x2C, "BIT abs", BIT, ABS, 4)
+OPCODE(0x2D, "AND abs", AND, ABS, 4)
+OPCODE(0x2E, "ROL abs", ROL, ABS, 6)
+OPCODE(0x2F, "???", NOP, IMPL, 6)
+OPCODE(0x30, "BMI rel", BMI, REL, 2)
+OPCODE(0x31, "AND ind,Y", AND, INDY, 5)
+OPCODE(0x32, "???", NOP, IMPL, 2)
+OPCODE(0x33, "???", NOP, IMPL, 8)
+OPCODE(0x34, "???", NOP, ZP, 4)
+OPCODE(0x35, "AND zpg,X", AND, ZPX, 4)
+OPCODE(0x36, "ROL zpg,X", ROL, ZPX, 6)
+OPCODE(0x37, "???", NOP, IMPL, 6)
+OPCODE(0x38, "SEC impl", SEC, IMPL, 2)
+OPCODE(0x39, "AND abs,Y", AND, ABSY, 4)
+OPCODE(0x3A, "???", NOP, IMPL, 2)
+OPCODE(0x3B, "???", NOP, IMPL, 7)
+OPCODE(0x3C, "???", NOP, ABSX, 4)
+OPCODE(0x3D, "AND abs,X", AND, ABSX, 4)
+OPCODE(0x3E, "ROL abs,X", ROL, ABSX, 7)
+OPCODE(0x3F, "???", NOP, IMPL, 7)
+OPCODE(0x40, "RTI impl", RTI, IMPL, 6)
+OPCODE(0x41, "EOR X,ind", EOR, XIND, 6)
+OPCODE(0x42, "???", NOP, IMPL, 2)
+OPCODE(0x43, "???", NOP, IMPL, 8)
+OPCODE(0x44, "???", NOP, ZP, 3)
+OPCODE(0x45, "EOR zpg", EOR, ZP, 3)
+OPCODE(0x46, "LSR zpg", LSR, ZP, 5)
+OPCODE(0x47, "???", NOP, IMPL, 5)
+OPCODE(0x48, "PHA impl", PHA, IMPL, 3)
+OPCODE(0x49, "EOR #", EOR, IMM, 2)
+OPCODE(0x4A, "LSR A", LSR, ACC, 2)
+OPCODE(0x4B, "???", NOP, IMPL, 2)
+OPCODE(0x4C, "JMP abs", JMP, ABS, 3)
+OPCODE(0x4D, "EOR abs", EOR, ABS, 4)
+OPCODE(0x4E, "LSR abs", LSR, ABS, 6)
+OPCODE(0x4F, "???", NOP, IMPL, 6)
+OPCODE(0x50, "BVC rel", BVC, REL, 2)
+OPCODE(0x51, "EOR ind,Y", EOR, INDY, 5)
+OPCODE(0x52, "???", NOP, IMPL, 2)
+OPCODE(0x53, "???", NOP, IMPL, 8)
+OPCODE(0x54, "???", NOP, ZP, 4)
+OPCODE(0x55, "EOR zpg,X", EOR, ZPX, 4)
+OPCODE(0x56, "LSR zpg,X", LSR, ZPX, 6)
+OPCODE(0x57, "???", NOP, IMPL, 6)
+OPCODE(0x58, "CLI impl", CLI, IMPL, 2)
+OPCODE(0x59, "EOR abs,Y", EOR, ABSY, 4)
+OPCODE(0x5A, "???", NOP, IMPL, 2)
+OPCODE(0x5B, "???", NOP, IMPL, 7)
+OPCODE(0x5C, "???", NOP, ABSX, 4)
+OPCODE(0x5D, "EOR abs,X", EOR, ABSX, 4)
+OPCODE(0x5E, "LSR abs,X", LSR, ABSX, 7)
+OPCODE(0x5F, "???", NOP, IMPL, 7)
+OPCODE(0x60, "RTS impl", RTS, IMPL, 6)
+OPCODE(0x61, "ADC X,ind", ADC, XIND, 6)
+OPCODE(0x62, "???", NOP, IMPL, 2)
+OPCODE(0x63, "???", NOP, IMPL, 8)
+OPCODE(0x64, "???", NOP, ZP, 3)
+OPCODE(0x65, "ADC zpg", ADC, ZP, 3)
+OPCODE(0x66, "ROR zpg", ROR, ZP, 5)
+OPCODE(0x67, "???", NOP, IMPL, 5)
+OPCODE(0x68, "PLA impl", PLA, IMPL, 4)
+OPCODE(0x69, "ADC #", ADC, IMM, 2)
+OPCODE(0x6A, "ROR A", ROR, ACC, 2)
+OPCODE(0x6B, "???", NOP, IMPL, 2)
+OPCODE(0x6C, "JMP ind", JMP, JMP_IND_BUG, 5)
+OPCODE(0x6D, "ADC abs", ADC, ABS, 4)
+OPCODE(0x6E, "ROR abs", ROR, ABS, 6)
+OPCODE(0x6F, "???", NOP, IMPL, 6)
+OPCODE(0x70, "BVS rel", BVS, REL, 2)
+OPCODE(0x71, "ADC ind,Y", ADC, INDY, 5)
+OPCODE(0x72, "???", NOP, IMPL, 2)
+OPCODE(0x73, "???", NOP, IMPL, 8)
+OPCODE(0x74, "???", NOP, ZP, 4)
+OPCODE(0x75, "ADC zpg,X", ADC, ZPX, 4)
+OPCODE(0x76, "ROR zpg,X", ROR, ZPX, 6)
+OPCODE(0x77, "???", NOP, IMPL, 6)
+OPCODE(0x78, "SEI impl", SEI, IMPL, 2)
+OPCODE(0x79, "ADC abs,Y", ADC, ABSY, 4)
+OPCODE(0x7A, "???", NOP, IMPL, 2)
+OPCODE(0x7B, "???", NOP, IMPL, 7)
+OPCODE(0x7C, "???", NOP, ABSX, 4)
+OPCODE(0x7D, "ADC abs,X", ADC, ABSX, 4)
+OPCODE(0x7E, "ROR abs,X", ROR, ABSX, 7)
+OPCODE(0x7F, "???", NOP, IMPL, 7)
+OPCODE(0x80, "???", NOP, IMM, 2)
+OPCODE(0x81, "STA X,ind", STA, XIND, 6)
+OPCODE(0x82, "???", NOP, IMPL, 2)
+OPCODE(0x83, "???", NOP, IMPL, 6)
+OPCODE(0x84, "STY zpg", STY, ZP, 3)
+OPCODE(0x85, "STA zpg", STA, ZP, 3)
+OPCODE(0x86, "STX zpg", STX, ZP, 3)
+OPCODE(0x87, "???", NOP, IMPL, 3)
+OPCODE(0x88, "DEY impl", DEY, IMPL, 2)
+OPCODE(0x89, "???", NOP, IMPL, 2)
+OPCODE(0x8A, "TXA impl", TXA, IMPL, 2)
+OPCODE(0x8B, "???", NOP, IMPL, 2)
+OPCODE(0x8C, "STY abs", STY, ABS, 4)
+OPCODE(0x8D, "STA abs", STA, ABS, 4)
+OPCODE(0x8E, "STX abs", STX, ABS, 4)
+OPCODE(0x8F, "???", NOP, IMPL, 4)
+OPCODE(0x90, "BCC rel", BCC, REL, 2)
+OPCODE(0x91, "STA ind,Y", STA, INDY, 6)
+OPCODE(0x92, "???", NOP, IMPL, 2)
+OPCODE(0x93, "???", NOP, IMPL, 6)
+OPCODE(0x94, "STY zpg,X", STY, ZPX, 4)
+OPCODE(0x95, "STA zpg,X", STA, ZPX, 4)
+OPCODE(0x96, "STX zpg,Y", STX, ZPY, 4)
+OPCODE(0x97, "???", NOP, IMPL, 4)
+OPCODE(0x98, "TYA impl", TYA, IMPL, 2)
+OPCODE(0x99, "STA abs,Y", STA, ABSY, 5)
+OPCODE(0x9A, "TXS impl", TXS, IMPL, 2)
+OPCODE(0x9B, "???", NOP, IMPL, 5)
+OPCODE(0x9C, "???", NOP, IMPL, 5)
+OPCODE(0x9D, "STA abs,X", STA, ABSX, 5)
+OPCODE(0x9E, "???", NOP, IMPL, 5)
+OPCODE(0x9F, "???", NOP, IMPL, 5)
+OPCODE(0xA0, "LDY #", LDY, IMM, 2)
+OPCODE(0xA1, "LDA X,ind", LDA, XIND, 6)
+OPCODE(0xA2, "LDX #", LDX, IMM, 2)
+OPCODE(0xA3, "???", NOP, IMPL, 6)
+OPCODE(0xA4, "LDY zpg", LDY, ZP, 3)
+OPCODE(0xA5, "LDA zpg", LDA, ZP, 3)
+OPCODE(0xA6, "LDX zpg", LDX, ZP, 3)
+OPCODE(0xA7, "???", NOP, IMPL, 3)
+OPCODE(0xA8, "TAY impl", TAY, IMPL, 2)
+OPCODE(0xA9, "LDA #", LDA, IMM, 2)
+OPCODE(0xAA, "TAX impl", TAX, IMPL, 2)
+OPCODE(0xAB, "???", NOP, IMPL, 2)
+OPCODE(0xAC, "LDY abs", LDY, ABS, 4)
+OPCODE(0xAD, "LDA abs", LDA, ABS, 4)
+OPCODE(0xAE, "LDX abs", LDX, ABS, 4)
+OPCODE(0xAF, "???", NOP, IMPL, 4)
+OPCODE(0xB0, "BCS rel", BCS, REL, 2)
+OPCODE(0xB1, "LDA ind,Y", LDA, INDY, 5)
+OPCODE(0xB2, "???", NOP, IMPL, 2)
+OPCODE(0xB3, "???", NOP, IMPL, 5)
+OPCODE(0xB4, "LDY zpg,X", LDY, ZPX, 4)
+OPCODE(0xB5, "LDA zpg,X", LDA, ZPX, 4)
+OPCODE(0xB6, "LDX zpg,Y", LDX, ZPY, 4)
+OPCODE(0xB7, "???", NOP, IMPL, 4)
+OPCODE(0xB8, "CLV impl", CLV, IMPL, 2)
+OPCODE(0xB9, "LDA abs,Y", LDA, ABSY, 4)
+OPCODE(0xBA, "TSX impl", TSX, IMPL, 2)
+OPCODE(0xBB, "???", NOP, IMPL, 4)
+OPCODE(0xBC, "LDY abs,X", LDY, ABSX, 4)
+OPCODE(0xBD, "LDA abs,X", LDA, ABSX, 4)
+OPCODE(0xBE, "LDX abs,Y", LDX, ABSY, 4)
+OPCODE(0xBF, "???", NOP, IMPL, 4)
+OPCODE(0xC0, "CPY #", CPY, IMM, 2)
+OPCODE(0xC1, "CMP X,ind", CMP, XIND, 6)
+OPCODE(0xC2, "???", NOP, IMPL, 2)
+OPCODE(0xC3, "???", NOP, IMPL, 8)
+OPCODE(0xC4, "CPY zpg", CPY, ZP, 3)
+OPCODE(0xC5, "CMP zpg", CMP, ZP, 3)
+OPCODE(0xC6, "DEC zpg", DEC, ZP, 5)
+OPCODE(0xC7, "???", NOP, IMPL, 5)
+OPCODE(0xC8, "INY impl", INY, IMPL, 2)
+OPCODE(0xC9, "CMP #", CMP, IMM, 2)
+OPCODE(0xCA, "DEX impl", DEX, IMPL, 2)
+OPCODE(0xCB, "???", NOP, IMPL, 2)
+OPCODE(0xCC, "CPY abs", CPY, ABS, 4)
+OPCODE(0xCD, "CMP abs", CMP, ABS, 4)
+OPCODE(0xCE, "DEC abs", DEC, ABS, 6)
+OPCODE(0xCF, "???", NOP, IMPL, 6)
+OPCODE(0xD0, "BNE rel", BNE, REL, 2)
+OPCODE(0xD1, "CMP ind,Y", CMP, INDY, 5)
+OPCODE(0xD2, "???", NOP, IMPL, 2)
+OPCODE(0xD3, "???", NOP, IMPL, 8)
+OPCODE(0xD4, "???", NOP, ZP, 4)
+OPCODE(0xD5, "CMP zpg,X", CMP, ZPX, 4)
+OPCODE(0xD6, "DEC zpg,X", DEC, ZPX, 6)
+OPCODE(0xD7, "???", NOP, IMPL, 6)
+OPCODE(0xD8, "CLD impl", CLD, IMPL, 2)
+OPCODE(0xD9, "CMP abs,Y", CMP, ABSY, 4)
+OPCODE(0xDA, "???", NOP, IMPL, 2)
+OPCODE(0xDB, "???", NOP, IMPL, 7)
+OPCODE(0xDC, "???", NOP, ABSX, 4)
+OPCODE(0xDD, "CMP abs,X", CMP, ABSX, 4)
+OPCODE(0xDE, "DEC abs,X", DEC, ABSX, 7)
+OPCODE(0xDF, "???", NOP, IMPL, 7)
+OPCODE(0xE0, "CPX #", CPX, IMM, 2)
+OPCODE(0xE1, "SBC X,ind", SBC, XIND, 6)
+OPCODE(0xE2, "???", NOP, IMPL, 2)
+OPCODE(0xE3, "???", NOP, IMPL, 8)
+OPCODE(0xE4, "CPX zpg", CPX, ZP, 3)
+OPCODE(0xE5, "SBC zpg", SBC, ZP, 3)
+OPCODE(0xE6, "INC zpg", INC, ZP, 5)
+OPCODE(0xE7, "???", NOP, IMPL, 5)
+OPCODE(0xE8, "INX impl", INX, IMPL, 2)
+OPCODE(0xE9, "SBC #", SBC, IMM, 2)
+OPCODE(0xEA, "NOP impl", NOP, IMPL, 2)
+OPCODE(0xEB, "???", NOP, IMPL, 2)
+OPCODE(0xEC, "CPX abs", CPX, ABS, 4)
+OPCODE(0xED, "SBC abs", SBC, ABS, 4)
+OPCODE(0xEE, "INC abs", INC, ABS, 6)
+OPCODE(0xEF, "???", NOP, IMPL, 6)
+OPCODE(0xF0, "BEQ rel", BEQ, REL, 2)
+OPCODE(0xF1, "SBC ind,Y", SBC, INDY, 5)
+OPCODE(0xF2, "???", NOP, IMPL, 2)
+OPCODE(0xF3, "???", NOP, IMPL, 8)
+OPCODE(0xF4, "???", NOP, ZP, 4)
+OPCODE(0xF5, "SBC zpg,X", SBC, ZPX, 4)
+OPCODE(0xF6, "INC zpg,X", INC, ZPX, 6)
+OPCODE(0xF7, "???", NOP, IMPL, 6)
+OPCODE(0xF8, "SED impl", SED, IMPL, 2)
+OPCODE(0xF9, "SBC abs,Y", SBC, ABSY, 4)
+OPCODE(0xFA, "???", NOP, IMPL, 2)
+OPCODE(0xFB, "???", NOP, IMPL, 7)
+OPCODE(0xFC, "???", NOP, ABSX, 4)
+OPCODE(0xFD, "SBC abs,X", SBC, ABSX, 4)
+OPCODE(0xFE, "INC abs,X", INC, ABSX, 7)
+OPCODE(0xFF, "???", NOP, IMPL, 7)
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "6502.h"
+#include "profile.h"
+
+typedef struct { // one line of the report
+	uint16_t start;
+	uint16_t end; // last address, inclusive
+	uint64_t cycles;
+	uint64_t counts;
+	char * name;
+} Hotspot;
+
+/* Symbols */
+
+// Label files come in many formats, so each line is taken apart loosely: the
+// address is the first word starting with $ or 0x (or failing that, the
+// first word of hex digits) and the name is the first other word. That
+// covers "name = $c000", "name EQU $c000", "c000 name" and VICE's
+// "al C:c000 .name".
+
+static int is_keyword(char * word)
+{
+	// "C" is the memory space in VICE's "al C:c000"
+	return strcasecmp(word, "al") == 0 || strcasecmp(word, "equ") == 0 || strcmp(word, "C") == 0;
+}
+
+static int parse_hex(char * word, int prefixed, long * addr)
+{
+	char * end;
+
+	if (word[0] == '$') word++;
+	else if (strncasecmp(word, "0x", 2) == 0) word += 2;
+	else if (prefixed) return 0;
+	*addr = strtol(word, &end, 16);
+	return end != word && *end == 0 && *addr >= 0 && *addr <= 0xFFFF;
+}
+
+static int parse_symbol(char * line, Symbol * s)
+{
+	char * words[8], * w;
+	int n = 0, i, found = -1, pass;
+	long addr;
+
+	for (w = strtok(line, " \t\r\n=:,;"); w && n < 8; w = strtok(NULL, " \t\r\n=:,;"))
+		words[n++] = w;
+	for (pass = 1; pass >= 0 && found < 0; pass--)
+		for (i = 0; i < n && found < 0; i++)
+			if (!is_keyword(words[i]) && parse_hex(words[i], pass, &addr)) found = i;
+	if (found < 0) return 0;
+	for (i = 0; i < n; i++) {
+		if (i == found || is_keyword(words[i])) continue;
+		if (words[i][0] == '.') words[i]++;
+		if (!isalpha((unsigned char)words[i][0]) && words[i][0] != '_') continue;
+		s->addr = addr;
+		s->name = strdup(words[i]);
+		return s->name != NULL;
+	}
+	return 0;
+}
+
+static int compare_symbols(const void * a, const void * b)
+{
+	return (int)((Symbol *)a)->addr - (int)((Symbol *)b)->addr;
+}
+
+static int load_symbols(struct Profile * profile, char * filename)
+{
+	FILE * fp = fopen(filename, "r");
+	char line[256];
+	int size = 0;
+	Symbol * grown;
+
+	if (fp == NULL) return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (profile->num_symbols == size) {
+			size = size ? size * 2 : 256;
+			grown = realloc(profile->symbols, size * sizeof(Symbol));
+			if (grown == NULL) break;
+			profile->symbols = grown;
+		}
+		profile->num_symbols += parse_symbol(line, &profile->symbols[profile->num_symbols]);
+	}
+	fclose(fp);
+	qsort(profile->symbols, profile->num_symbols, sizeof(Symbol), compare_symbols);
+	return 0;
+}
+
+static Symbol * find_symbol(struct Profile * profile, uint16_t addr) // the closest symbol at or below addr
+{
+	int lo = 0, hi = profile->num_symbols, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (profile->symbols[mid].addr <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo ? &profile->symbols[lo - 1] : NULL;
+}
+
+/* Report */
+
+static int compare_hotspots(const void * a, const void * b)
+{
+	uint64_t x = ((Hotspot *)a)->cycles, y = ((Hotspot *)b)->cycles;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void print_hotspots(struct Profile * profile, char * title, Hotspot * spots, int n, uint64_t total)
+{
+	char addr[10];
+	Symbol * s;
+	int i;
+
+	qsort(spots, n, sizeof(Hotspot), compare_hotspots);
+	fprintf(profile->report, "\n%s\n      cycles      %%      instructions  address      symbol\n", title);
+	for (i = 0; i < n && i < PROFILE_TOP; i++) {
+		fprintf(profile->report, "%12llu  %5.1f%%  %16llu  ", (unsigned long long)spots[i].cycles,
+			100.0 * spots[i].cycles / total, (unsigned long long)spots[i].counts);
+		if (spots[i].end != spots[i].start) sprintf(addr, "%04X-%04X", spots[i].start, spots[i].end);
+		else sprintf(addr, "%04X", spots[i].start);
+		if (spots[i].name) fprintf(profile->report, "%-9s    %s\n", addr, spots[i].name);
+		else if ((s = find_symbol(profile, spots[i].start)) && s->addr == spots[i].start)
+			fprintf(profile->report, "%-9s    %s\n", addr, s->name);
+		else if (s) fprintf(profile->report, "%-9s    %s+%d\n", addr, s->name, spots[i].start - s->addr);
+		else fprintf(profile->report, "%s\n", addr);
+	}
+}
+
+static void write_report(struct Profile * profile)
+{
+	Hotspot * spots = malloc(0x10000 * sizeof(Hotspot));
+	uint64_t total = 0, counts = 0;
+	int n, i, last;
+	Symbol * s;
+
+	if (spots == NULL) return;
+	for (i = 0; i < 0x10000; i++) {
+		total += profile->cycles[i];
+		counts += profile->counts[i];
+	}
+	fprintf(profile->report, "%llu cycles in %llu instructions\n", (unsigned long long)total, (unsigned long long)counts);
+	if (total == 0) total = 1;
+
+	for (n = 0, i = 0; i < 0x10000; i++)
+		if (profile->counts[i]) spots[n++] = (Hotspot) {i, i, profile->cycles[i], profile->counts[i], NULL};
+	print_hotspots(profile, "hot addresses", spots, n, total);
+
+	for (n = 0, last = -PROFILE_GAP - 1, i = 0; i < 0x10000; i++) {
+		if (!profile->counts[i]) continue;
+		if (i - last > PROFILE_GAP) spots[n++] = (Hotspot) {i, i, 0, 0, NULL};
+		spots[n - 1].end = i;
+		spots[n - 1].cycles += profile->cycles[i];
+		spots[n - 1].counts += profile->counts[i];
+		last = i;
+	}
+	print_hotspots(profile, "hot ranges", spots, n, total);
+
+	if (profile->num_symbols) { // each routine runs from its label to the next one
+		for (n = 0, i = 0; i < 0x10000; i++) {
+			if (!profile->counts[i] || (s = find_symbol(profile, i)) == NULL) continue;
+			if (n == 0 || spots[n - 1].name != s->name) spots[n++] = (Hotspot) {s->addr, s->addr, 0, 0, s->name};
+			spots[n - 1].cycles += profile->cycles[i];
+			spots[n - 1].counts += profile->counts[i];
+		}
+		print_hotspots(profile, "routines", spots, n, total);
+	}
+	free(spots);
+}
+
+/* Profile */
+
+int open_profile(CPU * cpu, char * filename, char * symbol_filename) // symbol_filename may be NULL
+{
+	struct Profile * profile = calloc(1, sizeof(struct Profile));
+
+	if (profile == NULL) return -1;
+	if (symbol_filename && load_symbols(profile, symbol_filename) != 0) {
+		free(profile);
+		return -1;
+	}
+	profile->report = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+	if (profile->report == NULL) {
+		free(profile->symbols);
+		free(profile);
+		return -1;
+	}
+	cpu->profile = profile;
+	return 0;
+}
+
+void close_profile(CPU * cpu) // writes the report
+{
+	struct Profile * profile = cpu->profile;
+	int i;
+
+	if (profile == NULL) return;
+	cpu->profile = NULL;
+	write_report(profile);
+	if (profile->report == stdout) fflush(stdout);
+	else fclose(profile->report);
+	for (i = 0; i < profile->num_symbols; i++) free(profile->symbols[i].name);
+	free(profile->symbols);
+	free(profile);
+}
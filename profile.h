@@ -0,0 +1,25 @@
+#define PROFILE_TOP 20 // lines in each part of the report
+#define PROFILE_GAP 3 // executed addresses at most this far apart are one range
+
+typedef struct {
+	uint16_t addr;
+	char * name;
+} Symbol;
+
+struct Profile {
+	uint64_t cycles[0x10000]; // spent in instructions starting at each address
+	uint64_t counts[0x10000]; // times each address was executed
+	FILE * report;
+	Symbol * symbols; // sorted by address
+	int num_symbols;
+};
+
+int open_profile(CPU * cpu, char * filename, char * symbol_filename);
+
+void close_profile(CPU * cpu);
+
+static inline void profile_step(CPU * cpu, uint16_t pc, int cycles)
+{
+	cpu->profile->cycles[pc] += cycles;
+	cpu->profile->counts[pc]++;
+}
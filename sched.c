@@ -0,0 +1,68 @@
+#include <stdint.h>
+
+#include "6502.h"
+
+// Devices ask to be called back at a given total_cycles value instead of
+// being stepped after every instruction. Pending events live in a small
+// binary min-heap, and cpu->deadline caches the earliest one so the run loop
+// only has a single comparison to make.
+
+/* Heap Helpers */
+
+static void swap(Event * a, Event * b)
+{
+	Event tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void sift_up(Event * heap, int i)
+{
+	while (i > 0 && heap[i].when < heap[(i - 1) / 2].when) {
+		swap(&heap[i], &heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(Event * heap, int n, int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && heap[child + 1].when < heap[child].when) child++;
+		if (heap[i].when <= heap[child].when) break;
+		swap(&heap[i], &heap[child]);
+		i = child;
+	}
+}
+
+static inline void update_deadline(CPU * cpu)
+{
+	cpu->deadline = cpu->num_events ? cpu->events[0].when : UINT64_MAX;
+}
+
+/* Scheduling */
+
+int schedule(CPU * cpu, uint64_t when, void (*callback)(CPU * cpu, void * data), void * data) // returns -1 if full
+{
+	if (cpu->num_events == MAX_EVENTS) return -1;
+
+	cpu->events[cpu->num_events] = (Event) {when, callback, data};
+	sift_up(cpu->events, cpu->num_events++);
+	update_deadline(cpu);
+	if (when < cpu->stop) cpu->stop = when; // scheduled from inside the run loop
+	return 0;
+}
+
+void run_events(CPU * cpu) // fires every event that is due, earliest first
+{
+	Event ev;
+
+	while (cpu->num_events > 0 && cpu->events[0].when <= cpu->total_cycles) {
+		ev = cpu->events[0];
+		cpu->events[0] = cpu->events[--cpu->num_events];
+		sift_down(cpu->events, cpu->num_events, 0);
+		ev.callback(cpu, ev.data); // may schedule more events
+	}
+	update_deadline(cpu);
+}
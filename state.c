@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "6502.h"
+#include "cache.h"
+#include "jit.h"
+
+// A snapshot file is a StateHeader padded out to STATE_MEMORY_OFFSET, the
+// 64KB of memory, then one StateBlock (followed by its data) for each device
+// state. Memory sits on a page boundary so load_state can map it straight
+// from the file instead of reading it in. Everything is in host byte order.
+
+#define STATE_MAGIC "6502SNAP"
+#define STATE_VERSION 1
+#define STATE_MEMORY_OFFSET 4096
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_blocks;
+	uint64_t total_cycles;
+	uint16_t pc;
+	uint8_t a;
+	uint8_t x;
+	uint8_t y;
+	uint8_t sp;
+	uint8_t sr;
+} StateHeader;
+
+typedef struct {
+	char name[16];
+	uint32_t size;
+} StateBlock;
+
+int add_device_state(CPU * cpu, const char * name, void * data, uint32_t size)
+{
+	if (cpu->num_device_states == MAX_DEVICE_STATES) return -1;
+	cpu->device_states[cpu->num_device_states++] = (DeviceState) {name, data, size};
+	return 0;
+}
+
+int save_state(CPU * cpu, char * filename)
+{
+	static const uint8_t padding[STATE_MEMORY_OFFSET];
+	StateHeader header = {
+		.version = STATE_VERSION,
+		.num_blocks = cpu->num_device_states,
+		.total_cycles = cpu->total_cycles,
+		.pc = cpu->PC,
+		.a = cpu->A,
+		.x = cpu->X,
+		.y = cpu->Y,
+		.sp = cpu->SP,
+		.sr = get_sr(cpu),
+	};
+	StateBlock block;
+	FILE * fp;
+	int i, ok;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL) return -1;
+	memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(padding, STATE_MEMORY_OFFSET - sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(cpu->memory, MEMORY_SIZE, 1, fp) == 1;
+	for (i = 0; ok && i < cpu->num_device_states; i++) {
+		memset(&block, 0, sizeof(block));
+		strncpy(block.name, cpu->device_states[i].name, sizeof(block.name) - 1);
+		block.size = cpu->device_states[i].size;
+		ok = fwrite(&block, sizeof(block), 1, fp) == 1;
+		ok = ok && fwrite(cpu->device_states[i].data, block.size, 1, fp) == 1;
+	}
+	return fclose(fp) == 0 && ok ? 0 : -1;
+}
+
+static void load_device_states(CPU * cpu, int fd, uint32_t num_blocks, off_t size)
+{
+	off_t pos = STATE_MEMORY_OFFSET + MEMORY_SIZE;
+	StateBlock block;
+	DeviceState * state;
+	uint32_t n;
+	int i;
+
+	for (n = 0; n < num_blocks; n++) {
+		if (pos + (off_t)sizeof(block) > size) return; // a truncated file keeps the states it has
+		if (pread(fd, &block, sizeof(block), pos) != sizeof(block)) return;
+		pos += sizeof(block);
+		if (pos + (off_t)block.size > size) return;
+		block.name[sizeof(block.name) - 1] = 0;
+		for (i = 0; i < cpu->num_device_states; i++) {
+			state = &cpu->device_states[i];
+			if (strcmp(state->name, block.name) == 0 && state->size == block.size)
+				if (pread(fd, state->data, block.size, pos) != block.size) return;
+		}
+		pos += block.size; // blocks for devices that aren't attached are skipped
+	}
+}
+
+void use_memory(CPU * cpu, uint8_t * memory) // switches to a MEMORY_SIZE mapping, which the CPU now owns
+{
+	uint8_t * old = cpu->memory;
+	int i;
+
+	cpu->memory = memory;
+	for (i = 0; i < 0x100; i++) { // move the memory map over to the new memory
+		if (cpu->pages[i].read == &old[i << 8]) cpu->pages[i].read = &memory[i << 8];
+		if (cpu->pages[i].write == &old[i << 8]) cpu->pages[i].write = &memory[i << 8];
+	}
+	if (old != cpu->ram) munmap(old, MEMORY_SIZE);
+	if (cpu->cache) flush_block_cache(cpu);
+	if (cpu->jit) flush_jit(cpu);
+}
+
+int load_state(CPU * cpu, char * filename)
+{
+	StateHeader header;
+	struct stat st;
+	uint8_t * memory;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return -1;
+	if (read(fd, &header, sizeof(header)) != sizeof(header)
+			|| memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != STATE_VERSION) {
+		close(fd);
+		return -1;
+	}
+	// a mapping past the end of the file would only fault once the guest touched it
+	if (fstat(fd, &st) != 0 || st.st_size < STATE_MEMORY_OFFSET + MEMORY_SIZE) {
+		close(fd);
+		return -1;
+	}
+
+	// private, so guest writes never reach the file
+	memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, STATE_MEMORY_OFFSET);
+	if (memory == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	load_device_states(cpu, fd, header.num_blocks, st.st_size);
+	close(fd);
+
+	use_memory(cpu, memory);
+
+	cpu->A = header.a;
+	cpu->X = header.x;
+	cpu->Y = header.y;
+	cpu->SP = header.sp;
+	cpu->PC = header.pc;
+	set_sr(cpu, header.sr);
+	cpu->total_cycles = header.total_cycles;
+	cpu->stuck_steps = 0;
+	return 0;
+}
+
+void free_state(CPU * cpu) // drops a mapped snapshot or image
+{
+	if (cpu->memory != cpu->ram) munmap(cpu->memory, MEMORY_SIZE);
+	cpu->memory = cpu->ram;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "stats.h"
+
+static const char * mode_names[NUM_MODES] = {
+	"ACC", "ABS", "ABSX", "ABSY", "IMM", "IMPL", "IND", "XIND",
+	"INDY", "REL", "ZP", "ZPX", "ZPY", "JMP_IND_BUG", "RESOLVED",
+};
+
+typedef struct { // one row of the histograms
+	uint64_t count;
+	uint64_t crossings; // page crossing penalties, not counting branches
+	uint64_t taken; // branches
+	uint64_t taken_crossings;
+} Counts;
+
+static void add_counts(Counts * c, uint64_t * steps, Mode mode)
+{
+	c->count += steps[0] + steps[1] + steps[2] + steps[3];
+	if (mode == REL) {
+		c->taken += steps[1] + steps[2];
+		c->taken_crossings += steps[2];
+	} else {
+		c->crossings += steps[1];
+	}
+}
+
+static void write_csv(FILE * fp, Counts * ops, Counts * modes)
+{
+	int i;
+
+	fprintf(fp, "group,name,count,page_crossings,branches_taken,branches_taken_crossing\n");
+	for (i = 0; i < 0x100; i++)
+		if (ops[i].count) fprintf(fp, "opcode,\"$%02X %s\",%llu,%llu,%llu,%llu\n", i, instructions[i].mnemonic,
+			(unsigned long long)ops[i].count, (unsigned long long)ops[i].crossings,
+			(unsigned long long)ops[i].taken, (unsigned long long)ops[i].taken_crossings);
+	for (i = 0; i < NUM_MODES; i++)
+		if (modes[i].count) fprintf(fp, "mode,%s,%llu,%llu,%llu,%llu\n", mode_names[i],
+			(unsigned long long)modes[i].count, (unsigned long long)modes[i].crossings,
+			(unsigned long long)modes[i].taken, (unsigned long long)modes[i].taken_crossings);
+}
+
+static void write_json(FILE * fp, Counts * ops, Counts * modes)
+{
+	const char * sep = "";
+	int i;
+
+	fprintf(fp, "{\n  \"opcodes\": [");
+	for (i = 0; i < 0x100; i++) {
+		if (!ops[i].count) continue;
+		fprintf(fp, "%s\n    {\"opcode\": %d, \"mnemonic\": \"%s\", \"mode\": \"%s\", \"count\": %llu, "
+			"\"page_crossings\": %llu, \"branches_taken\": %llu, \"branches_taken_crossing\": %llu}",
+			sep, i, instructions[i].mnemonic, mode_names[instructions[i].mode], (unsigned long long)ops[i].count,
+			(unsigned long long)ops[i].crossings, (unsigned long long)ops[i].taken, (unsigned long long)ops[i].taken_crossings);
+		sep = ",";
+	}
+	fprintf(fp, "\n  ],\n  \"modes\": {");
+	for (sep = "", i = 0; i < NUM_MODES; i++) {
+		if (!modes[i].count) continue;
+		fprintf(fp, "%s\n    \"%s\": {\"count\": %llu, \"page_crossings\": %llu, \"branches_taken\": %llu, "
+			"\"branches_taken_crossing\": %llu}", sep, mode_names[i], (unsigned long long)modes[i].count,
+			(unsigned long long)modes[i].crossings, (unsigned long long)modes[i].taken, (unsigned long long)modes[i].taken_crossings);
+		sep = ",";
+	}
+	fprintf(fp, "\n  }\n}\n");
+}
+
+static void write_stats(struct Stats * stats) // overwrites the file with the counts so far
+{
+	Counts ops[0x100] = {{0}}, modes[NUM_MODES] = {{0}};
+	size_t len = strlen(stats->filename);
+	FILE * fp;
+	int i;
+
+	fp = fopen(stats->filename, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Warning: could not write \"%s\"\n", stats->filename);
+		return;
+	}
+	for (i = 0; i < 0x100; i++) {
+		add_counts(&ops[i], stats->steps[i], instructions[i].mode);
+		add_counts(&modes[instructions[i].mode], stats->steps[i], instructions[i].mode);
+	}
+	if (len >= 5 && strcmp(stats->filename + len - 5, ".json") == 0) write_json(fp, ops, modes);
+	else write_csv(fp, ops, modes);
+	fclose(fp);
+}
+
+#ifdef STATS // only scheduled by open_stats in a stats build
+static void check_stats(CPU * cpu, void * data)
+{
+	struct Stats * stats = data;
+
+	if (stats->requested) {
+		stats->requested = 0;
+		write_stats(stats);
+	}
+	schedule(cpu, cpu->total_cycles + STATS_CHECK_CYCLES, check_stats, stats);
+}
+#endif
+
+void request_stats(CPU * cpu) // safe from a signal handler; the file is written at the next check
+{
+	if (cpu->stats) cpu->stats->requested = 1;
+}
+
+int open_stats(CPU * cpu, char * filename)
+{
+#ifdef STATS
+	cpu->stats = calloc(1, sizeof(struct Stats));
+	if (cpu->stats == NULL) return -1;
+	cpu->stats->filename = filename;
+	schedule(cpu, cpu->total_cycles + STATS_CHECK_CYCLES, check_stats, cpu->stats);
+	return 0;
+#else
+	return -1; // nothing would be counted
+#endif
+}
+
+void close_stats(CPU * cpu) // writes the final counts
+{
+	if (cpu->stats == NULL) return;
+	write_stats(cpu->stats);
+	free(cpu->stats);
+	cpu->stats = NULL;
+}
@@ -0,0 +1,30 @@
+#include <signal.h>
+
+#define STATS_CHECK_CYCLES 100000 // how often a SIGUSR1 request is looked for
+
+// Counters are only compiled in with STATS defined (make stats, which builds
+// 6502-emu-stats); otherwise COUNT_STEP is empty and open_stats fails.
+#ifdef STATS
+#define COUNT_STEP(cpu, op) count_step(cpu, op)
+#else
+#define COUNT_STEP(cpu, op)
+#endif
+
+struct Stats {
+	// instructions run, by opcode and extra cycles: for branches 1 is
+	// taken and 2 is taken to another page, otherwise 1 is a page crossing
+	uint64_t steps[0x100][4];
+	char * filename; // CSV, or JSON if it ends in .json
+	volatile sig_atomic_t requested; // set by SIGUSR1
+};
+
+int open_stats(CPU * cpu, char * filename);
+
+void close_stats(CPU * cpu);
+
+void request_stats(CPU * cpu);
+
+static inline void count_step(CPU * cpu, uint8_t op) // after the instruction has run
+{
+	if (cpu->stats) cpu->stats->steps[op][cpu->extra_cycles & 3]++;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "6502.h"
+#include "trace.h"
+
+int format_record(char * buf, size_t size, TraceRecord * r) // almost match for NES dump for easier comparison
+{
+	Instruction inst = instructions[r->bytes[0]];
+	char raw[9];
+
+	if (lengths[inst.mode] == 3)
+		sprintf(raw, "%02X %02X %02X", r->bytes[0], r->bytes[1], r->bytes[2]);
+	else if (lengths[inst.mode] == 2)
+		sprintf(raw, "%02X %02X   ", r->bytes[0], r->bytes[1]);
+	else
+		sprintf(raw, "%02X      ", r->bytes[0]);
+	return snprintf(buf, size, "%04X  %s  %-10s                      A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d\n",
+		r->pc, raw, inst.mnemonic, r->a, r->x, r->y, r->p, r->sp, (int)((r->cycles * 3) % 341));
+}
+
+void print_record(FILE * fp, TraceRecord * r)
+{
+	char line[TRACE_LINE_SIZE];
+
+	format_record(line, sizeof(line), r);
+	fputs(line, fp);
+}
+
+/* Binary Trace File */
+
+int open_trace(CPU * cpu, char * filename)
+{
+	struct Trace * trace = malloc(sizeof(struct Trace));
+
+	if (trace == NULL) return -1;
+	trace->fp = fopen(filename, "wb");
+	if (trace->fp == NULL) {
+		free(trace);
+		return -1;
+	}
+	trace->used = 0;
+	fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, trace->fp);
+	cpu->trace = trace;
+	return 0;
+}
+
+void flush_trace(CPU * cpu)
+{
+	struct Trace * trace = cpu->trace;
+
+	fwrite(trace->buf, sizeof(TraceRecord), trace->used, trace->fp);
+	trace->used = 0;
+}
+
+void close_trace(CPU * cpu)
+{
+	if (cpu->trace == NULL) return;
+	flush_trace(cpu);
+	fclose(cpu->trace->fp);
+	free(cpu->trace);
+	cpu->trace = NULL;
+}
+
+/* Trace Ring */
+
+int init_ring(CPU * cpu, uint32_t size) // size is rounded up to a power of two
+{
+	uint32_t n = 1;
+
+	while (n < size) n <<= 1;
+	cpu->ring = malloc(sizeof(struct Ring) + n * sizeof(TraceRecord));
+	if (cpu->ring == NULL) return -1;
+	cpu->ring->mask = n - 1;
+	cpu->ring->next = 0;
+	return 0;
+}
+
+void free_ring(CPU * cpu)
+{
+	free(cpu->ring);
+	cpu->ring = NULL;
+}
+
+void dump_ring(CPU * cpu, FILE * fp) // oldest first; the last line is the most recent step
+{
+	struct Ring * ring = cpu->ring;
+	uint64_t i = ring->next > ring->mask ? ring->next - ring->mask - 1 : 0;
+
+	fprintf(fp, "last %u steps:\n", (unsigned)(ring->next - i));
+	for (; i != ring->next; i++)
+		print_record(fp, &ring->buf[i & ring->mask]);
+	fflush(fp);
+}
@@ -0,0 +1,73 @@
+#define TRACE_MAGIC "6502TRC1"
+#define TRACE_BUFFER_RECORDS 65536 // records collected before each write
+#define TRACE_LINE_SIZE 128 // enough for one line of -v output
+
+// One record per executed instruction, taken just before it runs, in host
+// byte order. trace2log.py turns a trace file back into -v style text.
+typedef struct __attribute__((packed)) {
+	uint64_t cycles; // total_cycles
+	uint16_t pc;
+	uint8_t bytes[3]; // opcode and the two bytes after it, whatever the length
+	uint8_t a;
+	uint8_t x;
+	uint8_t y;
+	uint8_t p;
+	uint8_t sp;
+} TraceRecord;
+
+struct Ring { // the last few records, kept in memory
+	uint32_t mask; // size - 1, the size being a power of two
+	uint64_t next; // records written so far
+	TraceRecord buf[];
+};
+
+struct Trace {
+	FILE * fp;
+	int used; // records waiting in buf
+	TraceRecord buf[TRACE_BUFFER_RECORDS];
+};
+
+int format_record(char * buf, size_t size, TraceRecord * r);
+
+void print_record(FILE * fp, TraceRecord * r);
+
+int open_trace(CPU * cpu, char * filename);
+
+void close_trace(CPU * cpu);
+
+void flush_trace(CPU * cpu);
+
+int init_ring(CPU * cpu, uint32_t size);
+
+void free_ring(CPU * cpu);
+
+void dump_ring(CPU * cpu, FILE * fp);
+
+static inline void fill_record(CPU * cpu, TraceRecord * r)
+{
+	r->cycles = cpu->total_cycles;
+	r->pc = cpu->PC;
+	r->bytes[0] = cpu->memory[cpu->PC];
+	r->bytes[1] = cpu->memory[(uint16_t)(cpu->PC+1)];
+	r->bytes[2] = cpu->memory[(uint16_t)(cpu->PC+2)];
+	r->a = cpu->A;
+	r->x = cpu->X;
+	r->y = cpu->Y;
+	r->p = get_sr(cpu);
+	r->sp = cpu->SP;
+}
+
+static inline void record_trace(CPU * cpu)
+{
+	struct Trace * trace = cpu->trace;
+
+	if (trace->used == TRACE_BUFFER_RECORDS) flush_trace(cpu);
+	fill_record(cpu, &trace->buf[trace->used++]);
+}
+
+static inline void record_ring(CPU * cpu)
+{
+	struct Ring * ring = cpu->ring;
+
+	fill_record(cpu, &ring->buf[ring->next++ & ring->mask]);
+}
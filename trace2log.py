@@ -0,0 +1,49 @@
+#!/usr/bin/env python
+
+# Turns a binary trace written with -t into the same text -v prints, which is
+# close to nestest.log (see compare.py).
+#
+# usage: trace2log.py TRACE [OUTPUT]
+
+import re
+import struct
+import sys
+
+MAGIC = b'6502TRC1'
+RECORD = struct.Struct('<QH3s5B') # cycles, pc, bytes, a, x, y, p, sp; see trace.h
+
+LENGTHS = {
+    'ACC': 1, 'ABS': 3, 'ABSX': 3, 'ABSY': 3, 'IMM': 2, 'IMPL': 1, 'IND': 3,
+    'XIND': 2, 'INDY': 2, 'REL': 2, 'ZP': 2, 'ZPX': 2, 'ZPY': 2, 'JMP_IND_BUG': 3,
+}
+
+
+def load_opcodes(path):
+    # the mnemonic and addressing mode of every opcode, from the table the emulator is built from
+    table = {}
+    with open(path) as f:
+        for m in re.finditer(r'OPCODE\((0x[0-9A-Fa-f]+), "([^"]*)", \w+, (\w+), \d+\)', f.read()):
+            table[int(m.group(1), 16)] = (m.group(2), LENGTHS[m.group(3)])
+    return table
+
+
+def main():
+    opcodes = load_opcodes(sys.path[0] + '/opcodes.h')
+    out = open(sys.argv[2], 'w') if len(sys.argv) > 2 else sys.stdout
+
+    with open(sys.argv[1], 'rb') as f:
+        if f.read(len(MAGIC)) != MAGIC:
+            sys.exit('%s is not a trace file' % sys.argv[1])
+        while True:
+            chunk = f.read(RECORD.size * 65536)
+            if not chunk:
+                break
+            for cycles, pc, code, a, x, y, p, sp in RECORD.iter_unpack(chunk):
+                mnemonic, length = opcodes[code[0]]
+                raw = ' '.join('%02X' % b for b in code[:length])
+                out.write('%04X  %-8s  %-10s                      A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d\n'
+                          % (pc, raw, mnemonic, a, x, y, p, sp, (cycles * 3) % 341))
+
+
+if __name__ == '__main__':
+    main()